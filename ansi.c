@@ -0,0 +1,539 @@
+#include "textmode.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MAX_PARAMS  16
+#define MAX_PARAM   9999
+
+typedef enum
+{
+    STATE_TEXT,
+    STATE_ESCAPE,   // after ESC
+    STATE_CSI,      // after ESC [
+    STATE_OSC,      // after ESC ], ignored up to BEL or ST (ESC \)
+    STATE_OSC_ESC,  // after ESC in an OSC
+    STATE_END,      // after ^Z (end of file), ignoring everything
+} ANSIState;
+
+// Per console, created when it is first written to.
+typedef struct
+{
+    ANSIState   state;
+    int         params[MAX_PARAMS];
+    int         num_params;
+    bool        private_mode;   // the sequence started with ? (or < = >)
+    bool        ans_file;       // ^Z ends the text: see DOS_SetANSIFile
+
+    // When a character is written in the last column, the cursor stays put
+    // until the next one, so that a full line followed by CR LF doesn't leave
+    // an empty line.
+    bool        wrap_pending;
+
+    int         fg;             // ANSI order, not including bold
+    int         bg;
+    bool        bold;
+    bool        blink;
+    bool        reverse;
+
+    int         saved_x;
+    int         saved_y;
+} ANSI;
+
+extern _Thread_local DOS_Console * _current_page;
+
+void ** DOS_ConsoleANSI(DOS_Console * console);
+void DOS_ConsoleSize(DOS_Console * console, int * w, int * h);
+void DOS_WriteRow(DOS_Console * console, int x, int y, const uint8_t * chars, int count);
+void DOS_EraseRow(DOS_Console * console, int y, int left, int right);
+void DOS_ScrollConsole(DOS_Console * console, int lines);
+
+// ANSI colors are in RGB bit order, CGA's are in BGR
+static const int cga_colors[8] = {
+    DOS_BLACK, DOS_RED, DOS_GREEN, DOS_BROWN,
+    DOS_BLUE, DOS_MAGENTA, DOS_CYAN, DOS_WHITE
+};
+
+static void ResetAttributes(ANSI * ansi)
+{
+    ansi->fg = 7;
+    ansi->bg = 0;
+    ansi->bold = false;
+    ansi->blink = false;
+    ansi->reverse = false;
+}
+
+static void ApplyAttributes(ANSI * ansi)
+{
+    int fg = cga_colors[ansi->fg & 7] | (ansi->fg & 8);
+    int bg = cga_colors[ansi->bg & 7] | (ansi->bg & 8);
+
+    if ( ansi->bold ) {
+        fg |= 8;
+    }
+
+    if ( ansi->reverse ) {
+        int temp = fg;
+        fg = bg;
+        bg = temp;
+    }
+
+    DOS_SetForeground(fg);
+    DOS_SetBackground(bg);
+    DOS_SetBlink(ansi->blink);
+}
+
+static ANSI * GetANSI(DOS_Console * console)
+{
+    void ** ansi = DOS_ConsoleANSI(console);
+
+    if ( *ansi == NULL ) {
+        ANSI * new_ansi = calloc(1, sizeof(*new_ansi));
+
+        if ( new_ansi == NULL ) {
+            fprintf(stderr, "DOS_WriteANSI: could not allocate memory\n");
+            return NULL;
+        }
+
+        new_ansi->state = STATE_TEXT;
+        ResetAttributes(new_ansi);
+        *ansi = new_ansi;
+    }
+
+    return *ansi;
+}
+
+static int Clamp(int value, int min, int max)
+{
+    return value < min ? min : value > max ? max : value;
+}
+
+// Parameter i, or `default_value` if missing or 0.
+static int Param(const ANSI * ansi, int i, int default_value)
+{
+    if ( i < ansi->num_params && ansi->params[i] != 0 ) {
+        return ansi->params[i];
+    }
+
+    return default_value;
+}
+
+static void MoveCursor(ANSI * ansi, int x, int y)
+{
+    int w, h;
+    DOS_ConsoleSize(_current_page, &w, &h);
+    DOS_GotoXY(Clamp(x, 0, w - 1), Clamp(y, 0, h - 1));
+    ansi->wrap_pending = false;
+}
+
+// Move down a line, scrolling at the bottom.
+static void LineFeed(ANSI * ansi)
+{
+    int w, h;
+    DOS_ConsoleSize(_current_page, &w, &h);
+
+    if ( DOS_GetY() == h - 1 ) {
+        DOS_ScrollConsole(_current_page, 1);
+    } else {
+        DOS_GotoXY(DOS_GetX(), DOS_GetY() + 1);
+    }
+
+    ansi->wrap_pending = false;
+}
+
+// Find the end of a run of printable characters, which is all but C0 controls.
+static const uint8_t * SkipText(const uint8_t * p, const uint8_t * end)
+{
+#ifdef __SSE2__
+    const __m128i control_bits = _mm_set1_epi8((char)0xE0);
+    const __m128i zero = _mm_setzero_si128();
+
+    while ( end - p >= 16 ) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)p);
+        __m128i controls = _mm_cmpeq_epi8(_mm_and_si128(bytes, control_bits), zero);
+        int mask = _mm_movemask_epi8(controls);
+
+        if ( mask ) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+#endif
+
+    while ( p < end && *p >= 0x20 ) {
+        p++;
+    }
+
+    return p;
+}
+
+// Write a run of characters, a row at a time, wrapping at the right edge.
+static void WriteText(ANSI * ansi, const uint8_t * text, int length)
+{
+    int w, h;
+    DOS_ConsoleSize(_current_page, &w, &h);
+
+    while ( length > 0 ) {
+        if ( ansi->wrap_pending ) {
+            DOS_GotoXY(0, DOS_GetY());
+            LineFeed(ansi);
+        }
+
+        int x = DOS_GetX();
+        int y = DOS_GetY();
+        int count = length < w - x ? length : w - x;
+
+        DOS_WriteRow(_current_page, x, y, text, count);
+        text += count;
+        length -= count;
+        x += count;
+
+        if ( x == w ) {
+            x = w - 1;
+            ansi->wrap_pending = true;
+        }
+
+        DOS_GotoXY(x, y);
+    }
+}
+
+static void Control(ANSI * ansi, uint8_t ch)
+{
+    switch ( ch ) {
+        case 0x00:
+        case '\a':
+            break;
+        case '\b':
+            MoveCursor(ansi, DOS_GetX() - 1, DOS_GetY());
+            break;
+        case '\t': {
+            int tab = (DOS_GetX() / 8 + 1) * 8;
+            MoveCursor(ansi, tab, DOS_GetY());
+            break;
+        }
+        case '\n': // also returns, as piped output has no CR
+            DOS_GotoXY(0, DOS_GetY());
+            LineFeed(ansi);
+            break;
+        case '\r':
+            MoveCursor(ansi, 0, DOS_GetY());
+            break;
+        case 0x1A: // end of an .ANS file, SAUCE record follows
+            if ( ansi->ans_file ) {
+                ansi->state = STATE_END;
+            } else {
+                WriteText(ansi, &ch, 1);
+            }
+            break;
+        case 0x1B:
+            ansi->state = STATE_ESCAPE;
+            break;
+        default: // as ANSI.SYS, other control characters are shown
+            WriteText(ansi, &ch, 1);
+            break;
+    }
+}
+
+// Select Graphic Rendition: colors and attributes.
+static void SetGraphicRendition(ANSI * ansi)
+{
+    if ( ansi->num_params == 0 ) {
+        ResetAttributes(ansi);
+    }
+
+    for ( int i = 0; i < ansi->num_params; i++ ) {
+        int p = ansi->params[i];
+
+        if ( p == 0 ) {
+            ResetAttributes(ansi);
+        } else if ( p == 1 ) {
+            ansi->bold = true;
+        } else if ( p == 2 || p == 22 ) {
+            ansi->bold = false;
+        } else if ( p == 5 || p == 6 ) {
+            ansi->blink = true;
+        } else if ( p == 25 ) {
+            ansi->blink = false;
+        } else if ( p == 7 ) {
+            ansi->reverse = true;
+        } else if ( p == 27 ) {
+            ansi->reverse = false;
+        } else if ( p >= 30 && p <= 37 ) {
+            ansi->fg = p - 30;
+        } else if ( p == 39 ) {
+            ansi->fg = 7;
+        } else if ( p >= 40 && p <= 47 ) {
+            ansi->bg = p - 40;
+        } else if ( p == 49 ) {
+            ansi->bg = 0;
+        } else if ( p >= 90 && p <= 97 ) {
+            ansi->fg = p - 90 + 8;
+        } else if ( p >= 100 && p <= 107 ) {
+            ansi->bg = p - 100 + 8;
+        } else if ( p == 38 || p == 48 ) {
+            // 256-color (5;n) or RGB (2;r;g;b). Only the first 16 of 256
+            // colors can be shown.
+            int mode = i + 1 < ansi->num_params ? ansi->params[i + 1] : 0;
+            if ( mode == 5 && i + 2 < ansi->num_params ) {
+                int color = ansi->params[i + 2];
+                if ( color < 16 ) {
+                    *(p == 38 ? &ansi->fg : &ansi->bg) = color;
+                }
+                i += 2;
+            } else if ( mode == 2 ) {
+                i += 4;
+            }
+        }
+    }
+
+    ApplyAttributes(ansi);
+}
+
+static void Erase(ANSI * ansi, bool whole_screen)
+{
+    int w, h;
+    DOS_ConsoleSize(_current_page, &w, &h);
+
+    int x = DOS_GetX();
+    int y = DOS_GetY();
+    int mode = Param(ansi, 0, 0);
+
+    switch ( mode ) {
+        case 0: // to end
+            DOS_EraseRow(_current_page, y, x, w);
+            if ( whole_screen ) {
+                for ( int y1 = y + 1; y1 < h; y1++ ) {
+                    DOS_EraseRow(_current_page, y1, 0, w);
+                }
+            }
+            break;
+        case 1: // from start
+            DOS_EraseRow(_current_page, y, 0, x + 1);
+            if ( whole_screen ) {
+                for ( int y1 = 0; y1 < y; y1++ ) {
+                    DOS_EraseRow(_current_page, y1, 0, w);
+                }
+            }
+            break;
+        default:
+            if ( whole_screen ) {
+                for ( int y1 = 0; y1 < h; y1++ ) {
+                    DOS_EraseRow(_current_page, y1, 0, w);
+                }
+                MoveCursor(ansi, 0, 0); // as ANSI.SYS, which art relies on
+            } else {
+                DOS_EraseRow(_current_page, y, 0, w);
+            }
+            break;
+    }
+}
+
+static void ExecuteCSI(ANSI * ansi, uint8_t command)
+{
+    int x = DOS_GetX();
+    int y = DOS_GetY();
+    int n = Param(ansi, 0, 1);
+
+    if ( ansi->private_mode ) {
+        if ( Param(ansi, 0, 0) == 25 && (command == 'h' || command == 'l') ) {
+            DOS_SetCursorType(command == 'h' ? DOS_CURSOR_NORMAL : DOS_CURSOR_NONE);
+        }
+        return;
+    }
+
+    switch ( command ) {
+        case 'A': MoveCursor(ansi, x, y - n); break;
+        case 'B':
+        case 'e': MoveCursor(ansi, x, y + n); break;
+        case 'C':
+        case 'a': MoveCursor(ansi, x + n, y); break;
+        case 'D': MoveCursor(ansi, x - n, y); break;
+        case 'E': MoveCursor(ansi, 0, y + n); break;
+        case 'F': MoveCursor(ansi, 0, y - n); break;
+        case 'G':
+        case '`': MoveCursor(ansi, n - 1, y); break;
+        case 'd': MoveCursor(ansi, x, n - 1); break;
+        case 'H':
+        case 'f': MoveCursor(ansi, Param(ansi, 1, 1) - 1, n - 1); break;
+        case 'J': Erase(ansi, true); break;
+        case 'K': Erase(ansi, false); break;
+        case 'S': DOS_ScrollConsole(_current_page, n); break;
+        case 'T': DOS_ScrollConsole(_current_page, -n); break;
+        case 'm': SetGraphicRendition(ansi); break;
+        case 's':
+            ansi->saved_x = x;
+            ansi->saved_y = y;
+            break;
+        case 'u': MoveCursor(ansi, ansi->saved_x, ansi->saved_y); break;
+        case 'X': {
+            int w, h;
+            DOS_ConsoleSize(_current_page, &w, &h);
+            DOS_EraseRow(_current_page, y, x, x + n < w ? x + n : w);
+            break;
+        }
+        default: // unsupported
+            break;
+    }
+}
+
+static void Escape(ANSI * ansi, uint8_t ch)
+{
+    ansi->state = STATE_TEXT;
+
+    switch ( ch ) {
+        case '[':
+            ansi->state = STATE_CSI;
+            ansi->num_params = 0;
+            ansi->private_mode = false;
+            memset(ansi->params, 0, sizeof(ansi->params));
+            break;
+        case ']': // operating system command, such as setting the title
+        case 'P': // device control string
+        case '^': // privacy message
+        case '_': // application program command
+            ansi->state = STATE_OSC;
+            break;
+        case '7':
+            ansi->saved_x = DOS_GetX();
+            ansi->saved_y = DOS_GetY();
+            break;
+        case '8':
+            MoveCursor(ansi, ansi->saved_x, ansi->saved_y);
+            break;
+        case 'D': // index
+            LineFeed(ansi);
+            break;
+        case 'E': // next line
+            DOS_GotoXY(0, DOS_GetY());
+            LineFeed(ansi);
+            break;
+        case 'M': // reverse index
+            if ( DOS_GetY() == 0 ) {
+                DOS_ScrollConsole(_current_page, -1);
+            } else {
+                MoveCursor(ansi, DOS_GetX(), DOS_GetY() - 1);
+            }
+            break;
+        case 'c': // reset
+            DOS_ResetANSI();
+            DOS_ClearScreen();
+            break;
+        default:
+            break;
+    }
+}
+
+static void CSI(ANSI * ansi, uint8_t ch)
+{
+    if ( ch >= '0' && ch <= '9' ) {
+        if ( ansi->num_params == 0 ) {
+            ansi->num_params = 1;
+        }
+        int * param = &ansi->params[ansi->num_params - 1];
+        *param = *param * 10 + ch - '0';
+        if ( *param > MAX_PARAM ) {
+            *param = MAX_PARAM;
+        }
+    } else if ( ch == ';' ) {
+        if ( ansi->num_params == 0 ) {
+            ansi->num_params = 1;
+        }
+        if ( ansi->num_params < MAX_PARAMS ) {
+            ansi->num_params++;
+        }
+    } else if ( ch >= 0x3C && ch <= 0x3F ) {
+        ansi->private_mode = true;
+    } else if ( ch >= 0x40 && ch <= 0x7E ) {
+        ansi->state = STATE_TEXT;
+        ExecuteCSI(ansi, ch);
+    } else if ( ch < 0x20 ) { // sequence cut short
+        ansi->state = STATE_TEXT;
+        Control(ansi, ch);
+    }
+    // (intermediate bytes are ignored)
+}
+
+// Skip the body of an OSC (or DCS, PM, APC) string.
+static void OSC(ANSI * ansi, uint8_t ch)
+{
+    if ( ansi->state == STATE_OSC_ESC ) {
+        if ( ch == '\\' ) {
+            ansi->state = STATE_TEXT;
+        } else { // a new sequence, cutting the string short
+            Escape(ansi, ch);
+        }
+    } else if ( ch == '\a' ) {
+        ansi->state = STATE_TEXT;
+    } else if ( ch == 0x1B ) {
+        ansi->state = STATE_OSC_ESC;
+    }
+}
+
+void DOS_WriteANSI(const char * data, size_t length)
+{
+    ANSI * ansi = GetANSI(_current_page);
+
+    if ( ansi == NULL ) {
+        return;
+    }
+
+    const uint8_t * p = (const uint8_t *)data;
+    const uint8_t * end = p + length;
+
+    while ( p < end ) {
+        switch ( ansi->state ) {
+            case STATE_TEXT: {
+                const uint8_t * text = p;
+                p = SkipText(p, end);
+
+                if ( p > text ) {
+                    WriteText(ansi, text, (int)(p - text));
+                }
+
+                if ( p < end ) {
+                    Control(ansi, *p++);
+                }
+                break;
+            }
+            case STATE_ESCAPE:
+                Escape(ansi, *p++);
+                break;
+            case STATE_CSI:
+                CSI(ansi, *p++);
+                break;
+            case STATE_OSC:
+            case STATE_OSC_ESC:
+                OSC(ansi, *p++);
+                break;
+            case STATE_END:
+                return;
+        }
+    }
+}
+
+void DOS_SetANSIFile(bool ans_file)
+{
+    ANSI * ansi = GetANSI(_current_page);
+
+    if ( ansi != NULL ) {
+        ansi->ans_file = ans_file;
+    }
+}
+
+void DOS_ResetANSI(void)
+{
+    ANSI * ansi = GetANSI(_current_page);
+
+    if ( ansi == NULL ) {
+        return;
+    }
+
+    ansi->state = STATE_TEXT;
+    ansi->wrap_pending = false;
+    ansi->saved_x = 0;
+    ansi->saved_y = 0;
+    ResetAttributes(ansi);
+    ApplyAttributes(ansi);
+}
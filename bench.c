@@ -0,0 +1,345 @@
+#include <SDL2/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "textmode.h"
+
+// Benchmarks. Build with optimizations: `make clean bench CFLAGS=-O2`
+
+int DOS_TakeDirtyRects(DOS_Console * console, const void * reader, SDL_Rect * rects);
+
+static double Seconds(Uint64 start)
+{
+    return (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+}
+
+// Time mixing a minute of sound with 0 to DOS_NUM_VOICES voices playing
+// alongside the speaker.
+static void BenchVoices(void)
+{
+    static int8_t stream[4096];
+    const int rate = 44100;
+    const int seconds = 60;
+    double previous = 0.0;
+    
+    printf("voices:\n");
+    
+    for ( int voices = 0; voices <= DOS_NUM_VOICES; voices++ ) {
+        DOS_Sound(440, seconds * 2000);
+        for ( int i = 0; i < DOS_NUM_VOICES; i++ ) {
+            if ( i < voices ) {
+                DOS_VoiceSound(i, 220 + i * 110, seconds * 2000);
+            } else {
+                DOS_VoiceStopSound(i);
+            }
+        }
+        
+        Uint64 start = SDL_GetPerformanceCounter();
+        for ( int i = 0; i < rate * seconds; i += sizeof(stream) ) {
+            DOS_RenderSound(stream, sizeof(stream));
+        }
+        double elapsed = Seconds(start);
+        
+        printf("  %d: %7.2f ms per minute, %5.2f ns per sample",
+               voices, elapsed * 1000.0, elapsed * 1e9 / (rate * seconds));
+        if ( voices > 0 ) {
+            printf(" (+%.2f ns)", (elapsed - previous) * 1e9 / (rate * seconds));
+        }
+        printf("\n");
+        
+        previous = elapsed;
+    }
+    
+    DOS_StopSound();
+}
+
+// Music on the speaker, a voice and the noise voice.
+static void QueueTestMusic(void)
+{
+    DOS_Play("t180 l8 o4 cdefgab>c");
+    DOS_VoicePlay(0, "t180 l4 o2 cege");
+    DOS_VoiceSound(DOS_NOISE_VOICE, 2000, 300);
+}
+
+// Check that offline rendering gives the same bytes whether the sound is
+// rendered in one go or in pieces of varying size, as an audio device may ask
+// for it. Returns false if not.
+static bool CheckOfflineRender(void)
+{
+    static int8_t whole[1 << 18];
+    static int8_t pieces[sizeof(whole)];
+    
+    QueueTestMusic();
+    int length = DOS_RenderSound(whole, sizeof(whole));
+    
+    QueueTestMusic();
+    int piece = 1;
+    for ( int done = 0; done < (int)sizeof(pieces); ) {
+        int count = piece < (int)sizeof(pieces) - done ? piece : (int)sizeof(pieces) - done;
+        DOS_RenderSound(pieces + done, count);
+        done += count;
+        piece = piece * 3 % 1021 + 1;
+    }
+    
+    bool same = memcmp(whole, pieces, sizeof(whole)) == 0;
+    printf("offline render: %d samples, %s\n",
+           length, same ? "identical in pieces" : "DIFFERENT in pieces");
+    
+    return same;
+}
+
+// Time printing characters to an 80x25 console in each mode, with 32-bit and
+// indexed surfaces, drawing them after each screenful as a frame would. The
+// best of several runs is reported.
+static void BenchCells(void)
+{
+    const DOS_Mode modes[] = { DOS_MODE40, DOS_MODE_EGA, DOS_MODE80, DOS_MODE_VGA };
+    const int screens = 200;
+    const int runs = 5;
+    SDL_Rect rects[25];
+    
+    printf("cells:\n");
+    
+    for ( size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++ ) {
+        DOS_Console * console = DOS_CreateConsole(80, 25, modes[i]);
+        
+        if ( console == NULL ) {
+            continue;
+        }
+        
+        for ( int indexed = 0; indexed <= 1; indexed++ ) {
+            DOS_SetIndexed(indexed);
+            
+            double best = 0.0;
+            
+            for ( int run = 0; run < runs; run++ ) {
+                Uint64 start = SDL_GetPerformanceCounter();
+                for ( int n = 0; n < screens; n++ ) {
+                    DOS_GotoXY(0, 0);
+                    DOS_SetForeground(n % 15 + 1);
+                    for ( int cell = 0; cell < 80 * 25; cell++ ) {
+                        DOS_PrintChar(cell + n);
+                    }
+                    DOS_TakeDirtyRects(console, rects, rects);
+                }
+                double elapsed = Seconds(start);
+                
+                if ( run == 0 || elapsed < best ) {
+                    best = elapsed;
+                }
+            }
+            
+            printf("  %dx%-2d %-7s %6.2f M cells/s\n",
+                   DOS_CharWidth(modes[i]),
+                   DOS_CharHeight(modes[i]),
+                   indexed ? "indexed" : "32-bit",
+                   screens * 80 * 25 / best / 1e6);
+        }
+        
+        DOS_FreeConsole(console);
+    }
+}
+
+// Draw an 80x25 console of every character in many colors with `backend` to
+// a new surface, through a software renderer. Returns NULL on failure.
+static SDL_Surface * DrawTestConsole(const DOS_Backend * backend, DOS_Mode mode)
+{
+    DOS_Console * console = DOS_CreateConsole(80, 25, mode);
+    SDL_Surface * target = SDL_CreateRGBSurfaceWithFormat(0,
+                                                          80 * DOS_CharWidth(mode),
+                                                          25 * DOS_CharHeight(mode),
+                                                          32,
+                                                          SDL_PIXELFORMAT_ARGB8888);
+    SDL_Renderer * renderer = target ? SDL_CreateSoftwareRenderer(target) : NULL;
+    
+    if ( console && renderer ) {
+        DOS_SetBackend(backend);
+        DOS_SetCursorType(DOS_CURSOR_NONE);
+        
+        for ( int cell = 0; cell < 80 * 25; cell++ ) {
+            DOS_SetForeground(cell % 16);
+            DOS_SetBackground(cell / 16 % 8);
+            DOS_PrintChar(cell);
+        }
+        
+        SDL_RenderClear(renderer);
+        DOS_RenderConsole(renderer, console, 0, 0);
+        SDL_RenderPresent(renderer);
+    } else {
+        SDL_FreeSurface(target);
+        target = NULL;
+    }
+    
+    DOS_FreeConsole(console);
+    if ( renderer ) {
+        SDL_DestroyRenderer(renderer);
+    }
+    
+    return target;
+}
+
+// Check that the surface and geometry backends draw the same pixels. Returns
+// false if not.
+static bool CheckBackends(void)
+{
+    const DOS_Mode modes[] = { DOS_MODE80, DOS_MODE_VGA };
+    bool all_same = true;
+    
+    for ( size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++ ) {
+        SDL_Surface * surface = DrawTestConsole(&dos_surface_backend, modes[i]);
+        SDL_Surface * geometry = DrawTestConsole(&dos_geometry_backend, modes[i]);
+        
+        if ( surface && geometry ) {
+            int rows = 0;
+            for ( int y = 0; y < surface->h; y++ ) {
+                const Uint8 * a = (const Uint8 *)surface->pixels + y * surface->pitch;
+                const Uint8 * b = (const Uint8 *)geometry->pixels + y * geometry->pitch;
+                rows += memcmp(a, b, surface->w * 4) != 0;
+            }
+            
+            printf("backends %dx%d: ", DOS_CharWidth(modes[i]), DOS_CharHeight(modes[i]));
+            if ( rows == 0 ) {
+                printf("surface and geometry identical\n");
+            } else {
+                printf("surface and geometry DIFFERENT in %d of %d rows\n", rows, surface->h);
+                all_same = false;
+            }
+        }
+        
+        SDL_FreeSurface(surface);
+        SDL_FreeSurface(geometry);
+    }
+    
+    return all_same;
+}
+
+// Time rendering consoles of several sizes to a software renderer with each
+// backend, with every cell or one row changed each frame.
+static void BenchRender(void)
+{
+    const int sizes[][2] = { { 40, 25 }, { 80, 25 }, { 80, 50 }, { 132, 60 } };
+    const struct { const DOS_Backend * backend; const char * name; } backends[] = {
+        { &dos_surface_backend, "surface" },
+        { &dos_geometry_backend, "geometry" },
+        { &dos_memory_backend, "memory" },
+    };
+    const int frames = 100;
+    
+    printf("render (software):\n");
+    
+    for ( size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++ ) {
+        int w = sizes[i][0];
+        int h = sizes[i][1];
+        DOS_Mode mode = DOS_MODE80;
+        
+        DOS_Console * console = DOS_CreateConsole(w, h, mode);
+        SDL_Surface * target = SDL_CreateRGBSurfaceWithFormat(0,
+                                                              w * DOS_CharWidth(mode),
+                                                              h * DOS_CharHeight(mode),
+                                                              32,
+                                                              SDL_PIXELFORMAT_ARGB8888);
+        SDL_Renderer * renderer = target ? SDL_CreateSoftwareRenderer(target) : NULL;
+        
+        if ( console == NULL || renderer == NULL ) {
+            DOS_FreeConsole(console);
+            SDL_FreeSurface(target);
+            continue;
+        }
+        
+        DOS_SetCursorType(DOS_CURSOR_NONE);
+        
+        for ( size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++ ) {
+            DOS_SetBackend(backends[b].backend);
+            printf("  %3dx%-2d %-8s", w, h, backends[b].name);
+            
+            for ( int full = 1; full >= 0; full-- ) {
+                Uint64 start = SDL_GetPerformanceCounter();
+                for ( int n = 0; n < frames; n++ ) {
+                    int rows = full ? h : 1;
+                    DOS_GotoXY(0, full ? 0 : n % h);
+                    DOS_SetForeground(n % 15 + 1);
+                    for ( int cell = 0; cell < w * rows; cell++ ) {
+                        DOS_PrintChar(cell + n);
+                    }
+                    SDL_RenderClear(renderer);
+                    DOS_RenderConsole(renderer, console, 0, 0);
+                    SDL_RenderPresent(renderer);
+                }
+                
+                printf("  %s %6.2f ms", full ? "all" : "row", Seconds(start) * 1000.0 / frames);
+            }
+            
+            printf("\n");
+        }
+        
+        DOS_FreeConsole(console);
+        SDL_DestroyRenderer(renderer);
+        SDL_FreeSurface(target);
+    }
+}
+
+// Time interpreting plain and colored text with DOS_WriteANSI.
+static void BenchANSI(void)
+{
+    const size_t size = 16 << 20;
+    char * plain = malloc(size);
+    char * colored = malloc(size);
+    
+    if ( plain == NULL || colored == NULL ) {
+        free(plain);
+        free(colored);
+        return;
+    }
+    
+    // lines of 60 characters
+    for ( size_t i = 0; i < size; i++ ) {
+        plain[i] = i % 61 == 60 ? '\n' : 'a' + i % 26;
+    }
+    
+    // words in changing colors
+    size_t length = 0;
+    for ( int i = 0; length + 32 < size; i++ ) {
+        length += sprintf(colored + length, "\x1b[%d;%dmword%d ", i % 2, 30 + i % 8, i % 10);
+    }
+    
+    DOS_Console * console = DOS_CreateConsole(80, 25, DOS_MODE80);
+    
+    if ( console ) {
+        printf("ANSI:\n");
+        
+        Uint64 start = SDL_GetPerformanceCounter();
+        DOS_WriteANSI(plain, size);
+        printf("  plain   %6.0f MB/s\n", size / Seconds(start) / 1e6);
+        
+        start = SDL_GetPerformanceCounter();
+        DOS_WriteANSI(colored, length);
+        printf("  colored %6.0f MB/s\n", length / Seconds(start) / 1e6);
+        
+        DOS_FreeConsole(console);
+    }
+    
+    free(plain);
+    free(colored);
+}
+
+int main(void)
+{
+    DOS_InitSoundEngine(DOS_SOUND_OFFLINE);
+    
+    BenchVoices();
+    
+    if ( !CheckOfflineRender() ) {
+        return EXIT_FAILURE;
+    }
+    
+    BenchCells();
+    
+    if ( !CheckBackends() ) {
+        return EXIT_FAILURE;
+    }
+    
+    BenchRender();
+    BenchANSI();
+    
+    return 0;
+}
@@ -1,8 +1,30 @@
 #include "textmode.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CURSOR_BLINK_MS 150 // cursor is shown/hidden for this long
+#define TEXT_BLINK_MS   300 // blinking text is shown/hidden for this long
+
+// Draws a glyph's mask (see DOS_FontMask) into a cell of the console surface.
+// `line` is whether the character extends into a 9th column.
+typedef void (* Rasterizer)(Uint8 * dst, int pitch, const uint8_t * mask, Uint32 fg, Uint32 bg, bool line);
+
+typedef struct
+{
+    DOS_Mode    mode;
+    Rasterizer  indexed;    // for 8-bit surfaces
+    Rasterizer  direct;     // for 32-bit surfaces
+} CellRasterizer;
+
 struct DOS_Console
 {
-    int             mode;       // 8 or 16
+    DOS_Mode        mode;
+    int             cell_w;     // character size in pixels
+    int             cell_h;
+    const CellRasterizer * rasterizer;
+    DOS_Font *      font;
     int             width;      // screen height in characters
     int             height;     // screen width in characters;
     int             cursor_x;
@@ -13,18 +35,90 @@ struct DOS_Console
     int             margin;     // \n's go here
     bool            blink;      // whether newly printed chars blink
     int             scale;
-    SDL_Surface *   surface;
     DOS_CharInfo *  buffer;
+    int             top;        // buffer row shown at the top (scrolling moves it)
     DOS_CursorType  cursor_type;
+    int             blink_cells; // number of cells with the blink attribute
+    bool            blink_hidden; // blink phase the cells were drawn with
+    int *           stale_left; // per row, range of cells changed but not yet
+    int *           stale_right; // given to the backend (right is exclusive)
+    SDL_Color       palette[DOS_NUMCOLORS + 1];
+    bool            indexed; // surface is (or will be) INDEX8, using `palette`
+    const DOS_Backend * backend;
+    void *          backend_state;
+    
+    // The rest belongs to dos_surface_backend, and is NULL with any other.
+    SDL_Surface *   surface;
+    int *           dirty_left; // per row, range of cells drawn since the
+    int *           dirty_right; // surface was last read (right is exclusive)
+    const void *    dirty_reader; // who last read the dirty rects
+    Uint32 *        row_colors; // per row, a bit for each palette index in it
+    Uint32          colors[DOS_NUMCOLORS + 1]; // palette in surface format
+    SDL_Renderer *  format_renderer; // texture format chosen for this renderer
+    Uint32          texture_format;
+    Uint32          texture_colors[DOS_NUMCOLORS + 1]; // if indexed
+    SDL_Texture *   texture;
+    SDL_Renderer *  texture_renderer;
+    SDL_Rect *      upload_rects; // one per row
+    void *          ansi;       // escape sequence state (see ansi.c)
 };
 
-DOS_Console * _current_page;
+_Thread_local DOS_Console * _current_page; // per thread, so each can drive its own screen
+
+void DOS_InvalidateConsole(DOS_Console * console);
+int DOS_TakeDirtyRects(DOS_Console * console, const void * reader, SDL_Rect * rects);
+const uint8_t * DOS_FontMask(const DOS_Font * font, uint8_t ch);
+
+static void * SurfaceCreate(DOS_Console * console, int w, int h, int cell_w, int cell_h);
+static void SurfaceDestroy(void * state);
+static bool SurfaceBeginFrame(void * state, SDL_Renderer * renderer);
+static void SurfaceUpdateCells(void * state, int x, int y, const DOS_CharInfo * cells, int count);
+static bool SurfacePresent(void * state, SDL_Renderer * renderer, const SDL_Rect * dst);
+static bool SurfaceResize(void * state, int w, int h);
+static void SurfaceClear(void * state);
+
+const DOS_Backend dos_surface_backend = {
+    .create         = SurfaceCreate,
+    .destroy        = SurfaceDestroy,
+    .begin_frame    = SurfaceBeginFrame,
+    .update_cells   = SurfaceUpdateCells,
+    .present        = SurfacePresent,
+    .resize         = SurfaceResize,
+    .clear          = SurfaceClear,
+};
+
+const DOS_Backend dos_memory_backend = { 0 }; // cells only: nothing is drawn
 
 // -----------------------------------------------------------------------------
 
 static DOS_CharInfo * GetCell(DOS_Console * console, int x, int y)
 {
-    return console->buffer + y * console->width + x;
+    int row = y + console->top;
+    
+    if ( row >= console->height ) {
+        row -= console->height;
+    }
+    
+    return console->buffer + row * console->width + x;
+}
+
+// Blank `count` cells as DOS_ClearScreen leaves them: transparent until
+// something is written, as the surface was before anything was drawn.
+static void ClearCells(DOS_CharInfo * cells, size_t count)
+{
+    memset(cells, 0, count * sizeof(*cells));
+    
+    for ( size_t i = 0; i < count; i++ ) {
+        cells[i].attributes.transparent = 1;
+        cells[i].attributes.cleared = 1;
+    }
+}
+
+// Whether writing to a cell keeps it transparent: only if it was made so by
+// DOS_SetTransparentBackground, not by being cleared.
+static bool StaysTransparent(const DOS_CharInfo * cell)
+{
+    return cell->attributes.transparent && !cell->attributes.cleared;
 }
 
 static void NewLine(DOS_Console * console)
@@ -45,11 +139,228 @@ static void AdvanceCursor(DOS_Console * console, int amount)
     }
 }
 
+// Cells are passed to the backend when the console is next rendered (or its
+// surface read), so cells changed several times, or scrolled away, are drawn
+// at most once.
+static void MarkStale(DOS_Console * console, int left, int right, int y)
+{
+    if ( left < console->stale_left[y] ) {
+        console->stale_left[y] = left;
+    }
+    
+    if ( right > console->stale_right[y] ) {
+        console->stale_right[y] = right;
+    }
+}
+
+static void MarkAllStale(DOS_Console * console)
+{
+    for ( int y = 0; y < console->height; y++ ) {
+        console->stale_left[y] = 0;
+        console->stale_right[y] = console->width;
+    }
+}
+
+static void MarkDirty(DOS_Console * console, int left, int right, int y)
+{
+    if ( left < console->dirty_left[y] ) {
+        console->dirty_left[y] = left;
+    }
+    
+    if ( right > console->dirty_right[y] ) {
+        console->dirty_right[y] = right;
+    }
+}
+
+// Mark the rows that use any of the palette indices in `mask` (a bit per
+// index) as needing to be read again.
+static void MarkColorsDirty(DOS_Console * console, Uint32 mask)
+{
+    for ( int y = 0; y < console->height; y++ ) {
+        if ( console->row_colors[y] & mask ) {
+            MarkDirty(console, 0, console->width, y);
+        }
+    }
+}
+
+static void MapColors(DOS_Console * console)
+{
+    if ( console->indexed ) {
+        SDL_SetPaletteColors(console->surface->format->palette,
+                             console->palette,
+                             0,
+                             DOS_NUMCOLORS + 1);
+        for ( int i = 0; i < DOS_NUMCOLORS + 1; i++ ) {
+            console->colors[i] = i;
+        }
+        return;
+    }
+    
+    for ( int i = 0; i < DOS_NUMCOLORS + 1; i++ ) {
+        const SDL_Color * c = &console->palette[i];
+        console->colors[i] = SDL_MapRGBA(console->surface->format, c->r, c->g, c->b, c->a);
+    }
+}
+
+// For indexed consoles, which are expanded to 32 bits when uploaded.
+static void MapTextureColors(DOS_Console * console)
+{
+    SDL_PixelFormat * format = SDL_AllocFormat(console->texture_format);
+    
+    if ( format == NULL ) {
+        return;
+    }
+    
+    for ( int i = 0; i < DOS_NUMCOLORS + 1; i++ ) {
+        const SDL_Color * c = &console->palette[i];
+        console->texture_colors[i] = SDL_MapRGBA(format, c->r, c->g, c->b, c->a);
+    }
+    
+    SDL_FreeFormat(format);
+}
+
+// A rasterizer for each cell size and pixel size, with the rows written out.
+// Glyphs come pre-expanded to a byte per pixel (0x00 or 0xFF), so each row is
+// drawn by masking the colors together, without testing any bits.
+
+// 8 pixels of an indexed surface
+static inline void BlendRowUint8(Uint8 * dst, const uint8_t * mask, Uint32 fg, Uint32 bg)
+{
+    uint64_t m, fgs, bgs;
+    memcpy(&m, mask, sizeof(m));
+    fgs = fg * 0x0101010101010101ull;
+    bgs = bg * 0x0101010101010101ull;
+    
+    uint64_t pixels = (fgs & m) | (bgs & ~m);
+    memcpy(dst, &pixels, sizeof(pixels));
+}
+
+// 8 pixels of a 32-bit surface
+static inline void BlendRowUint32(Uint8 * dst, const uint8_t * mask, Uint32 fg, Uint32 bg)
+{
+#ifdef __SSE2__
+    __m128i m = _mm_loadl_epi64((const __m128i *)mask);
+    m = _mm_unpacklo_epi8(m, m);
+    __m128i lo = _mm_unpacklo_epi16(m, m);
+    __m128i hi = _mm_unpackhi_epi16(m, m);
+    __m128i fgs = _mm_set1_epi32(fg);
+    __m128i bgs = _mm_set1_epi32(bg);
+    
+    lo = _mm_or_si128(_mm_and_si128(lo, fgs), _mm_andnot_si128(lo, bgs));
+    hi = _mm_or_si128(_mm_and_si128(hi, fgs), _mm_andnot_si128(hi, bgs));
+    _mm_storeu_si128((__m128i *)dst, lo);
+    _mm_storeu_si128((__m128i *)dst + 1, hi);
+#else
+    Uint32 pixels[8];
+    for ( int x = 0; x < 8; x++ ) {
+        Uint32 m = -(Uint32)(mask[x] & 1);
+        pixels[x] = (fg & m) | (bg & ~m);
+    }
+    memcpy(dst, pixels, sizeof(pixels));
+#endif
+}
+
+// The 9th column repeats the 8th if `line` is set (line_mask is all ones).
+#define RASTER_ROW(type, width, i) \
+    { \
+        Uint8 * row = dst + (i) * pitch; \
+        BlendRow##type(row, mask + (i) * 8, fg, bg); \
+        if ( width == 9 ) { \
+            type m = line_mask & -(type)(mask[(i) * 8 + 7] & 1); \
+            ((type *)row)[8] = (type)((fg & m) | (bg & ~m)); \
+        } \
+    }
+
+#define RASTER_ROWS_8(type, width) \
+    RASTER_ROW(type, width, 0) RASTER_ROW(type, width, 1) \
+    RASTER_ROW(type, width, 2) RASTER_ROW(type, width, 3) \
+    RASTER_ROW(type, width, 4) RASTER_ROW(type, width, 5) \
+    RASTER_ROW(type, width, 6) RASTER_ROW(type, width, 7)
+
+#define RASTER_ROWS_14(type, width) \
+    RASTER_ROWS_8(type, width) \
+    RASTER_ROW(type, width, 8) RASTER_ROW(type, width, 9) \
+    RASTER_ROW(type, width, 10) RASTER_ROW(type, width, 11) \
+    RASTER_ROW(type, width, 12) RASTER_ROW(type, width, 13)
+
+#define RASTER_ROWS_16(type, width) \
+    RASTER_ROWS_14(type, width) \
+    RASTER_ROW(type, width, 14) RASTER_ROW(type, width, 15)
+
+#define DEFINE_RASTERIZER(name, type, width, height) \
+    static void name \
+    (   Uint8 * dst, \
+        int pitch, \
+        const uint8_t * mask, \
+        Uint32 fg, \
+        Uint32 bg, \
+        bool line ) \
+    { \
+        type line_mask = -(type)line; \
+        (void)line_mask; \
+        RASTER_ROWS_##height(type, width) \
+    }
+
+DEFINE_RASTERIZER(Raster8x8_8, Uint8, 8, 8)
+DEFINE_RASTERIZER(Raster8x8_32, Uint32, 8, 8)
+DEFINE_RASTERIZER(Raster8x14_8, Uint8, 8, 14)
+DEFINE_RASTERIZER(Raster8x14_32, Uint32, 8, 14)
+DEFINE_RASTERIZER(Raster8x16_8, Uint8, 8, 16)
+DEFINE_RASTERIZER(Raster8x16_32, Uint32, 8, 16)
+DEFINE_RASTERIZER(Raster9x16_8, Uint8, 9, 16)
+DEFINE_RASTERIZER(Raster9x16_32, Uint32, 9, 16)
+
+static const CellRasterizer rasterizers[] = {
+    { DOS_MODE40,   Raster8x8_8,  Raster8x8_32 },
+    { DOS_MODE_EGA, Raster8x14_8, Raster8x14_32 },
+    { DOS_MODE80,   Raster8x16_8, Raster8x16_32 },
+    { DOS_MODE_VGA, Raster9x16_8, Raster9x16_32 },
+};
+
+static const CellRasterizer * FindRasterizer(DOS_Mode mode)
+{
+    for ( size_t i = 0; i < sizeof(rasterizers) / sizeof(rasterizers[0]); i++ ) {
+        if ( rasterizers[i].mode == mode ) {
+            return &rasterizers[i];
+        }
+    }
+    
+    return NULL;
+}
+
 static bool ValidCoord(DOS_Console * c, int x, int y)
 {
     return x >= 0 && x < c->width && y >= 0 && y < c->height;
 }
 
+// Replace the console's backend and have it draw everything. On failure, the
+// old one is kept.
+static bool SetBackend(DOS_Console * console, const DOS_Backend * backend)
+{
+    void * state = NULL;
+    
+    if ( backend->create ) {
+        state = backend->create(console,
+                                console->width,
+                                console->height,
+                                console->cell_w,
+                                console->cell_h);
+        if ( state == NULL ) {
+            return false;
+        }
+    }
+    
+    if ( console->backend && console->backend->destroy ) {
+        console->backend->destroy(console->backend_state);
+    }
+    
+    console->backend = backend;
+    console->backend_state = state;
+    MarkAllStale(console);
+    
+    return true;
+}
+
 static DOS_Console * NewConsoleError(DOS_Console * c, const char * message)
 {
     fprintf(stderr, "DOS_CreateConsole: %s\n", message);
@@ -67,14 +378,42 @@ DOS_Console * DOS_CreateConsole(int w, int h, DOS_Mode mode)
     
     _current_page = console;
     console->mode           = mode;
+    console->cell_w         = DOS_CharWidth(mode);
+    console->cell_h         = DOS_CharHeight(mode);
+    console->rasterizer     = FindRasterizer(mode);
+    console->font           = DOS_GetDefaultFont(mode);
     console->width          = w;
     console->height         = h;
     console->buffer         = NULL;
+    console->top            = 0;
+    console->backend        = NULL;
+    console->backend_state  = NULL;
+    console->surface        = NULL;
+    console->stale_left     = NULL;
+    console->stale_right    = NULL;
+    console->dirty_left     = NULL;
+    console->dirty_right    = NULL;
+    console->dirty_reader   = NULL;
+    console->format_renderer = NULL;
+    console->indexed        = false;
+    console->texture_format = SDL_PIXELFORMAT_RGBA32;
+    console->texture        = NULL;
+    console->texture_renderer = NULL;
+    console->upload_rects   = NULL;
+    console->row_colors     = NULL;
+    console->ansi           = NULL;
     console->blink          = false;
     console->tab_size       = 4;
     console->cursor_type    = DOS_CURSOR_NORMAL;
     console->margin         = 0;
     console->scale          = 1;
+    console->blink_cells    = 0;
+    console->blink_hidden   = false;
+    memcpy(console->palette, dos_palette, sizeof(console->palette));
+    
+    if ( console->rasterizer == NULL ) {
+        return NewConsoleError(console, "unsupported text mode");
+    }
     
     console->buffer = calloc(w * h, sizeof(*console->buffer));
     
@@ -82,25 +421,14 @@ DOS_Console * DOS_CreateConsole(int w, int h, DOS_Mode mode)
         return NewConsoleError(console, "could not allocate buffer");
     }
     
-    Uint32 rmask, gmask, bmask, amask;
-    #if SDL_BYTEORDER == SDL_BIG_ENDIAN
-        rmask = 0xff000000;
-        gmask = 0x00ff0000;
-        bmask = 0x0000ff00;
-        amask = 0x000000ff;
-    #else
-        rmask = 0x000000ff;
-        gmask = 0x0000ff00;
-        bmask = 0x00ff0000;
-        amask = 0xff000000;
-    #endif
-    console->surface = SDL_CreateRGBSurface(0,
-                                            w * DOS_CHAR_WIDTH,
-                                            h * mode,
-                                            32,
-                                            rmask, gmask, bmask, amask);
+    console->stale_left = malloc(h * sizeof(*console->stale_left));
+    console->stale_right = malloc(h * sizeof(*console->stale_right));
     
-    if ( console->surface == NULL ) {
+    if ( console->stale_left == NULL || console->stale_right == NULL ) {
+        return NewConsoleError(console, "could not allocate stale rows");
+    }
+    
+    if ( !SetBackend(console, &dos_surface_backend) ) {
         return NewConsoleError(console, "failed to create console surface");
     }
     
@@ -112,12 +440,15 @@ DOS_Console * DOS_CreateConsole(int w, int h, DOS_Mode mode)
 void DOS_FreeConsole(DOS_Console * console)
 {
     if ( console ) {
+        if ( console->backend && console->backend->destroy ) {
+            console->backend->destroy(console->backend_state);
+        }
         if ( console->buffer ) {
             free(console->buffer);
         }
-        if ( console->surface ) {
-            SDL_FreeSurface(console->surface);
-        }
+        free(console->stale_left);
+        free(console->stale_right);
+        free(console->ansi);
         free(console);
     }
 }
@@ -129,13 +460,21 @@ void DOS_SetActiveConsole(DOS_Console * console)
 
 void DOS_ClearScreen()
 {
-    size_t size = sizeof(DOS_CharInfo) * _current_page->width * _current_page->height;
-    memset(_current_page->buffer, 0, size);
+    ClearCells(_current_page->buffer, (size_t)_current_page->width * _current_page->height);
+    _current_page->top = 0;
+    
+    if ( _current_page->backend->clear ) {
+        _current_page->backend->clear(_current_page->backend_state);
+    }
     
-    SDL_FillRect(_current_page->surface, NULL, 0);
+    for ( int y = 0; y < _current_page->height; y++ ) {
+        _current_page->stale_left[y] = _current_page->width;
+        _current_page->stale_right[y] = 0;
+    }
     
     _current_page->cursor_x = 0;
     _current_page->cursor_y = 0;
+    _current_page->blink_cells = 0;
     _current_page->fg_color = DOS_WHITE;
     _current_page->bg_color = DOS_BLACK;
 }
@@ -166,6 +505,7 @@ void DOS_SetTransparentBackground()
         for ( int x = 0; x < _current_page->width; x++ ) {
             DOS_CharInfo * cell = GetCell(_current_page, x, y);
             cell->attributes.transparent = 1;
+            cell->attributes.cleared = 0;
         }
     }
 }
@@ -180,82 +520,134 @@ void SetPixel(int x, int y, const SDL_Color * c)
     *target_pixel = SDL_MapRGBA(_current_page->surface->format, c->r, c->g, c->b, c->a);
 }
 
-void DOS_PrintChar(uint8_t ch)
+static bool BlinkHidden(void)
 {
-    DOS_CharInfo * cell = GetCell(_current_page, _current_page->cursor_x, _current_page->cursor_y);
-    cell->character = ch;
-    cell->attributes.fg_color = _current_page->fg_color;
-    cell->attributes.bg_color = _current_page->bg_color;
-    cell->attributes.blink = _current_page->blink;
+    return SDL_GetTicks() % (TEXT_BLINK_MS * 2) < TEXT_BLINK_MS;
+}
+
+// Draw `cell` at x, y into the console surface, which must be locked.
+static void RasterCell(DOS_Console * console, int x, int y, const DOS_CharInfo * cell)
+{
+    uint8_t ch = cell->character;
+    
+    const uint8_t * mask = DOS_FontMask(console->font, ch);
     
-    const uint8_t * data;
-    const uint8_t * DOS_Data8(uint8_t ch);
-    const uint8_t * DOS_Data16(uint8_t ch);
+    Uint32 fg = console->colors[cell->attributes.fg_color];
+    Uint32 bg = console->colors[cell->attributes.bg_color];
     
-    if ( _current_page->mode == DOS_MODE40 ) {
-        data = DOS_Data8(ch);
+    if ( cell->attributes.blink && console->blink_hidden ) {
+        fg = bg;
+    }
+    
+    if ( cell->attributes.transparent ) {
+        bg = console->colors[DOS_NUMCOLORS];
+    }
+    
+    int pitch = console->surface->pitch;
+    int bpp = console->surface->format->BytesPerPixel;
+    Uint8 * row = (Uint8 *)console->surface->pixels;
+    row += y * pitch * console->cell_h + x * console->cell_w * bpp;
+    
+    bool line = ch >= 0xC0 && ch <= 0xDF;
+    
+    if ( bpp == 1 ) { // indexed
+        console->rasterizer->indexed(row, pitch, mask, fg, bg, line);
     } else {
-        data = DOS_Data16(ch);
+        console->rasterizer->direct(row, pitch, mask, fg, bg, line);
     }
+}
+
+// Pass all stale cells to the backend.
+static void FlushStale(DOS_Console * console)
+{
+    void (* update)(void *, int, int, const DOS_CharInfo *, int);
+    update = console->backend->update_cells;
     
-    SDL_LockSurface(_current_page->surface);
+    for ( int y = 0; y < console->height; y++ ) {
+        int left = console->stale_left[y];
+        int right = console->stale_right[y];
+        
+        if ( left >= right ) {
+            continue;
+        }
+        
+        if ( update ) {
+            update(console->backend_state, left, y, GetCell(console, left, y), right - left);
+        }
+        
+        console->stale_left[y] = console->width;
+        console->stale_right[y] = 0;
+    }
+}
 
-    int pitch = _current_page->surface->pitch;
-    int bpp = _current_page->surface->format->BytesPerPixel;
-    int x = _current_page->cursor_x;
-    int y = _current_page->cursor_y;
-    Uint8 * pixel = (Uint8 *)_current_page->surface->pixels;
-    pixel += y * pitch * _current_page->mode + x * DOS_CHAR_WIDTH * bpp;
-    
-    for ( int y1 = 0; y1 < (int)_current_page->mode; y1++, data++ ) {
-        for ( int x1 = DOS_CHAR_WIDTH - 1; x1 >= 0; x1-- ) {
-            if ( *data & (1 << x1) ) {
-                const SDL_Color * c;
-                if ( cell->attributes.blink && SDL_GetTicks() % 600 < 300) {
-                    c = &dos_palette[cell->attributes.bg_color];
-                } else {
-                    c = &dos_palette[cell->attributes.fg_color];
-                }
-                *(Uint32 *)pixel = SDL_MapRGBA(_current_page->surface->format, c->r, c->g, c->b, c->a);
-            } else {
-                if ( !cell->attributes.transparent ) {
-                    const SDL_Color * c = &dos_palette[cell->attributes.bg_color];
-                    *(Uint32 *)pixel = SDL_MapRGBA(_current_page->surface->format, c->r, c->g, c->b, c->a);
-                } else {
-                    *(Uint32 *)pixel = SDL_MapRGBA(_current_page->surface->format, 0, 0, 0, 0);
-                }
+// Redraw blinking cells if the blink phase has changed since they were drawn.
+static void UpdateBlink(DOS_Console * console)
+{
+    bool hidden = BlinkHidden();
+    
+    if ( hidden == console->blink_hidden ) {
+        return;
+    }
+    
+    console->blink_hidden = hidden;
+    
+    if ( console->blink_cells == 0 ) {
+        return;
+    }
+    
+    for ( int y = 0; y < console->height; y++ ) {
+        for ( int x = 0; x < console->width; x++ ) {
+            if ( GetCell(console, x, y)->attributes.blink ) {
+                MarkStale(console, x, x + 1, y);
             }
-            pixel += bpp;
         }
-        pixel -= DOS_CHAR_WIDTH * bpp;
-        pixel += pitch;
     }
+}
 
-    SDL_UnlockSurface(_current_page->surface);
+// Keep the blinking cell count up to date when a cell is overwritten.
+static void ReplaceCell(DOS_Console * console, DOS_CharInfo * cell, DOS_CharInfo new_cell)
+{
+    console->blink_cells -= cell->attributes.blink;
+    console->blink_cells += new_cell.attributes.blink;
+    *cell = new_cell;
+}
+
+void DOS_PrintChar(uint8_t ch)
+{
+    int x = _current_page->cursor_x;
+    int y = _current_page->cursor_y;
+    
+    DOS_CharInfo new_cell = { 0 };
+    new_cell.character = ch;
+    new_cell.attributes.fg_color = _current_page->fg_color;
+    new_cell.attributes.bg_color = _current_page->bg_color;
+    new_cell.attributes.blink = _current_page->blink;
+    
+    DOS_CharInfo * cell = GetCell(_current_page, x, y);
+    new_cell.attributes.transparent = StaysTransparent(cell);
+    ReplaceCell(_current_page, cell, new_cell);
+    MarkStale(_current_page, x, x + 1, y);
     
     AdvanceCursor(_current_page, 1);
 }
 
-void DOS_PrintString(const char * format, ...)
+// Format and print a string, converting it from UTF-8 first if `utf8`.
+static void PrintString(const char * format, va_list args, bool utf8)
 {
-    int     len;
-    char *  buffer;
-    char *  ch;
-    
-    va_list args[2];
-    va_start(args[0], format);
-    va_copy(args[1], args[0]);
+    va_list copy;
+    va_copy(copy, args);
     
-    len = vsnprintf(NULL, 0, format, args[0]);
-    buffer = calloc(len + 1, sizeof(char));
-    vsnprintf(buffer, len + 1, format, args[1]);
+    int len = vsnprintf(NULL, 0, format, args);
+    char * buffer = calloc(len + 1, sizeof(char));
+    vsnprintf(buffer, len + 1, format, copy);
+    va_end(copy);
     
-    va_end(args[0]);
-    va_end(args[1]);
+    if ( utf8 ) {
+        len = (int)DOS_UTF8ToCP437(buffer, buffer, len);
+    }
     
-    ch = buffer;
-    while ( *ch ) {
-        switch ( *ch ) {
+    for ( int i = 0; i < len && buffer[i]; i++ ) {
+        switch ( buffer[i] ) {
             case '\n':
                 NewLine(_current_page);
                 break;
@@ -265,61 +657,612 @@ void DOS_PrintString(const char * format, ...)
                 } while ( _current_page->cursor_x % _current_page->tab_size != 0 );
                 break;
             default:
-                DOS_PrintChar(*ch);
+                DOS_PrintChar(buffer[i]);
                 break;
         }
-        ch++;
     }
     
     free(buffer);
 }
 
-static void RenderCursor(SDL_Renderer * renderer, int x_offset, int y_offset)
+void DOS_PrintString(const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    PrintString(format, args, false);
+    va_end(args);
+}
+
+void DOS_PrintStringUTF8(const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    PrintString(format, args, true);
+    va_end(args);
+}
+
+static void
+RenderCursor
+(   SDL_Renderer * renderer,
+    DOS_Console * console,
+    int x_offset,
+    int y_offset,
+    int scale )
 {
     SDL_Rect cursor;
-    cursor.x = _current_page->cursor_x * DOS_CHAR_WIDTH + x_offset;
-    cursor.y = _current_page->cursor_y * _current_page->mode + y_offset;
-    cursor.w = DOS_CHAR_WIDTH;
+    cursor.x = console->cursor_x * console->cell_w + x_offset;
+    cursor.y = console->cursor_y * console->cell_h + y_offset;
+    cursor.w = console->cell_w;
     
-    switch ( _current_page->cursor_type ) {
+    switch ( console->cursor_type ) {
         case DOS_CURSOR_NORMAL:
-            cursor.h = _current_page->mode / 5;
-            cursor.y += _current_page->mode - cursor.h;
+            cursor.h = console->cell_h / 5;
+            cursor.y += console->cell_h - cursor.h;
             break;
         case DOS_CURSOR_FULL:
-            cursor.h = _current_page->mode;
+            cursor.h = console->cell_h;
             break;
         default:
             return;
     }
+    
+    cursor.x = (cursor.x - x_offset) * scale + x_offset;
+    cursor.y = (cursor.y - y_offset) * scale + y_offset;
+    cursor.w *= scale;
+    cursor.h *= scale;
  
-    if ( SDL_GetTicks() % 300 < 150 ) {
+    if ( SDL_GetTicks() % (CURSOR_BLINK_MS * 2) < CURSOR_BLINK_MS ) {
         return;
     }
         
     uint8_t r, g, b, a;
     SDL_GetRenderDrawColor(renderer, &r, &g, &b, &a);
     
-    DOS_SetColor(renderer, _current_page->fg_color);
+    DOS_SetColor(renderer, console->fg_color);
     SDL_RenderFillRect(renderer, &cursor);
     
     SDL_SetRenderDrawColor(renderer, r, g, b, a); // restore
 }
 
+// The texture format the renderer handles natively, so that uploads need no
+// conversion.
+static Uint32 PreferredFormat(SDL_Renderer * renderer)
+{
+    SDL_RendererInfo info;
+    
+    if ( SDL_GetRendererInfo(renderer, &info) == 0 ) {
+        for ( Uint32 i = 0; i < info.num_texture_formats; i++ ) {
+            Uint32 format = info.texture_formats[i];
+            if ( !SDL_ISPIXELFORMAT_FOURCC(format)
+                && SDL_BITSPERPIXEL(format) == 32
+                && SDL_ISPIXELFORMAT_ALPHA(format) ) {
+                return format;
+            }
+        }
+    }
+    
+    return SDL_PIXELFORMAT_ARGB8888;
+}
+
+// Replace the surface with one in `format` and draw everything again.
+static bool SetSurfaceFormat(DOS_Console * console, Uint32 format)
+{
+    SDL_Surface * surface;
+    surface = SDL_CreateRGBSurfaceWithFormat(0,
+                                             console->surface->w,
+                                             console->surface->h,
+                                             SDL_BITSPERPIXEL(format),
+                                             format);
+    if ( surface == NULL ) {
+        fprintf(stderr, "could not convert console to %s (%s)\n",
+                SDL_GetPixelFormatName(format), SDL_GetError());
+        return false;
+    }
+    
+    SDL_FreeSurface(console->surface);
+    console->surface = surface;
+    console->indexed = format == SDL_PIXELFORMAT_INDEX8;
+    MapColors(console);
+    MarkAllStale(console);
+    
+    return true;
+}
+
+// Choose the texture format for the renderer. Non-indexed surfaces are
+// converted to it, so they can be uploaded as is.
+static void MatchRenderer(DOS_Console * console, SDL_Renderer * renderer)
+{
+    if ( renderer == console->format_renderer ) {
+        return;
+    }
+    
+    console->format_renderer = renderer;
+    console->texture_format = PreferredFormat(renderer);
+    
+    if ( console->indexed ) {
+        MapTextureColors(console);
+        DOS_InvalidateConsole(console);
+    } else if ( console->texture_format != console->surface->format->format ) {
+        if ( !SetSurfaceFormat(console, console->texture_format) ) {
+            console->texture_format = console->surface->format->format;
+        }
+    }
+}
+
+// Copy part of an indexed surface to the texture, looking up each pixel's
+// color.
+static void UploadIndexed(DOS_Console * console, const SDL_Rect * r)
+{
+    void * pixels;
+    int pitch;
+    
+    if ( SDL_LockTexture(console->texture, r, &pixels, &pitch) != 0 ) {
+        return;
+    }
+    
+    const Uint32 * colors = console->texture_colors;
+    SDL_Surface * surface = console->surface;
+    const Uint8 * src = (const Uint8 *)surface->pixels + r->y * surface->pitch + r->x;
+    Uint8 * dst = pixels;
+    
+    for ( int y = 0; y < r->h; y++, src += surface->pitch, dst += pitch ) {
+        Uint32 * out = (Uint32 *)dst;
+        for ( int x = 0; x < r->w; x++ ) {
+            out[x] = colors[src[x]];
+        }
+    }
+    
+    SDL_UnlockTexture(console->texture);
+}
+
+// Upload whatever changed since last time to the console's texture, creating
+// it if needed.
+static SDL_Texture * UpdateTexture(SDL_Renderer * renderer, DOS_Console * console)
+{
+    MatchRenderer(console, renderer);
+    
+    if ( console->texture && console->texture_renderer != renderer ) {
+        SDL_DestroyTexture(console->texture);
+        console->texture = NULL;
+    }
+    
+    if ( console->texture == NULL ) {
+        console->texture = SDL_CreateTexture(renderer,
+                                             console->texture_format,
+                                             SDL_TEXTUREACCESS_STREAMING,
+                                             console->surface->w,
+                                             console->surface->h);
+        if ( console->texture == NULL ) {
+            return NULL;
+        }
+        
+        SDL_SetTextureBlendMode(console->texture, SDL_BLENDMODE_BLEND);
+        console->texture_renderer = renderer;
+        console->dirty_reader = NULL; // upload everything
+    }
+    
+    int count = DOS_TakeDirtyRects(console, console, console->upload_rects);
+    SDL_Surface * surface = console->surface;
+    
+    for ( int i = 0; i < count; i++ ) {
+        SDL_Rect * r = &console->upload_rects[i];
+        
+        if ( console->indexed ) {
+            UploadIndexed(console, r);
+            continue;
+        }
+        
+        // The formats match, so each row is copied as is.
+        Uint8 * pixels = (Uint8 *)surface->pixels;
+        pixels += r->y * surface->pitch + r->x * sizeof(Uint32);
+        SDL_UpdateTexture(console->texture, r, pixels, surface->pitch);
+    }
+    
+    return console->texture;
+}
+
+// dos_surface_backend: cells are drawn to the console's surface, which is
+// uploaded to its texture where it changed. The state is the console itself.
+
+static void * SurfaceCreate(DOS_Console * console, int w, int h, int cell_w, int cell_h)
+{
+    console->dirty_left = malloc(h * sizeof(*console->dirty_left));
+    console->dirty_right = malloc(h * sizeof(*console->dirty_right));
+    console->upload_rects = malloc(h * sizeof(*console->upload_rects));
+    console->row_colors = malloc(h * sizeof(*console->row_colors));
+    
+    // until rendered, when it's changed to the renderer's preferred format
+    Uint32 format = console->indexed ? SDL_PIXELFORMAT_INDEX8 : SDL_PIXELFORMAT_RGBA32;
+    console->surface = SDL_CreateRGBSurfaceWithFormat(0,
+                                                      w * cell_w,
+                                                      h * cell_h,
+                                                      SDL_BITSPERPIXEL(format),
+                                                      format);
+    
+    if ( console->dirty_left == NULL
+        || console->dirty_right == NULL
+        || console->upload_rects == NULL
+        || console->row_colors == NULL
+        || console->surface == NULL ) {
+        SurfaceDestroy(console);
+        return NULL;
+    }
+    
+    for ( int y = 0; y < h; y++ ) {
+        console->row_colors[y] = 1; // a new surface is all index 0
+    }
+    
+    MapColors(console);
+    DOS_InvalidateConsole(console);
+    
+    return console;
+}
+
+static void SurfaceDestroy(void * state)
+{
+    DOS_Console * console = state;
+    
+    if ( console->surface ) {
+        SDL_FreeSurface(console->surface);
+    }
+    if ( console->texture ) {
+        SDL_DestroyTexture(console->texture);
+    }
+    free(console->dirty_left);
+    free(console->dirty_right);
+    free(console->upload_rects);
+    free(console->row_colors);
+    
+    console->surface = NULL;
+    console->texture = NULL;
+    console->texture_renderer = NULL;
+    console->format_renderer = NULL;
+    console->dirty_left = NULL;
+    console->dirty_right = NULL;
+    console->dirty_reader = NULL;
+    console->upload_rects = NULL;
+    console->row_colors = NULL;
+}
+
+static bool SurfaceBeginFrame(void * state, SDL_Renderer * renderer)
+{
+    if ( renderer ) {
+        MatchRenderer(state, renderer);
+    }
+    
+    return true;
+}
+
+static void SurfaceUpdateCells(void * state, int x, int y, const DOS_CharInfo * cells, int count)
+{
+    DOS_Console * console = state;
+    Uint32 used = 0;
+    
+    SDL_LockSurface(console->surface);
+    
+    for ( int i = 0; i < count; i++ ) {
+        const DOS_Attributes * a = &cells[i].attributes;
+        used |= 1u << a->fg_color;
+        used |= 1u << (a->transparent ? DOS_NUMCOLORS : a->bg_color);
+        RasterCell(console, x + i, y, &cells[i]);
+    }
+    
+    SDL_UnlockSurface(console->surface);
+    MarkDirty(console, x, x + count, y);
+    
+    if ( x == 0 && count == console->width ) {
+        console->row_colors[y] = used; // the whole row was drawn
+    } else {
+        console->row_colors[y] |= used;
+    }
+}
+
+static bool SurfacePresent(void * state, SDL_Renderer * renderer, const SDL_Rect * dst)
+{
+    if ( renderer == NULL ) {
+        return true;
+    }
+    
+    SDL_Texture * texture = UpdateTexture(renderer, state);
+    
+    if ( texture ) {
+        SDL_RenderCopy(renderer, texture, NULL, dst);
+    }
+    
+    return true; // (there's nothing to fall back to)
+}
+
+static bool SurfaceResize(void * state, int w, int h)
+{
+    DOS_Console * console = state;
+    
+    SurfaceDestroy(console);
+    
+    return SurfaceCreate(console, w, h, console->cell_w, console->cell_h) != NULL;
+}
+
+static void SurfaceClear(void * state)
+{
+    DOS_Console * console = state;
+    
+    SDL_FillRect(console->surface, NULL, console->colors[DOS_NUMCOLORS]);
+    DOS_InvalidateConsole(console);
+    
+    for ( int y = 0; y < console->height; y++ ) {
+        console->row_colors[y] = 1u << DOS_NUMCOLORS;
+    }
+}
+
+// Called when a backend's begin_frame or present fails. Returns false if the
+// surface backend can't be set up either.
+static bool FallBackToSurface(DOS_Console * console, SDL_Renderer * renderer)
+{
+    fprintf(stderr, "DOS_RenderConsole: backend can't draw, using a texture (%s)\n",
+            SDL_GetError());
+    
+    if ( !SetBackend(console, &dos_surface_backend) ) {
+        return false;
+    }
+    
+    dos_surface_backend.begin_frame(console->backend_state, renderer);
+    
+    return true;
+}
+
 void DOS_RenderConsole(SDL_Renderer * renderer, DOS_Console * console, int x, int y)
 {
-    SDL_Texture * texture = SDL_CreateTextureFromSurface(renderer, console->surface);
+    const DOS_Backend * backend = console->backend;
+    
+    if ( renderer == NULL && backend == &dos_surface_backend ) {
+        return; // (cells are drawn to the surface when it's read)
+    }
+    
+    UpdateBlink(console);
+    
+    if ( backend->begin_frame && !backend->begin_frame(console->backend_state, renderer) ) {
+        if ( !FallBackToSurface(console, renderer) ) {
+            return;
+        }
+        
+        backend = console->backend;
+    }
+    
+    FlushStale(console);
+    
+    if ( backend->present == NULL ) {
+        return; // nothing is displayed
+    }
     
     SDL_Rect dst;
     dst.x = x,
     dst.y = y,
-    dst.w = console->width * DOS_CHAR_WIDTH * console->scale;
-    dst.h = console->height * console->mode * console->scale;
-    SDL_RenderCopy(renderer, texture, NULL, &dst);
+    dst.w = console->width * console->cell_w * console->scale;
+    dst.h = console->height * console->cell_h * console->scale;
+    
+    if ( !backend->present(console->backend_state, renderer, &dst) ) {
+        // draw this frame with the surface instead
+        if ( !FallBackToSurface(console, renderer) ) {
+            return;
+        }
+        
+        FlushStale(console);
+        dos_surface_backend.present(console->backend_state, renderer, &dst);
+    }
+    
+    if ( renderer ) {
+        RenderCursor(renderer, console, x, y, 1);
+    }
+}
+
+// Internal functions for screens that draw the console surface themselves.
+
+// Prepare the surface to be read. Changed cells are drawn to it by
+// DOS_TakeDirtyRects, which must be called before reading. `format` is set to
+// the 32-bit format to display it in. If the surface is indexed, `colors` is
+// set to its palette in that format, otherwise NULL. Returns NULL if the
+// console has another backend, and so no surface.
+SDL_Surface *
+DOS_UpdateConsoleSurface
+(   DOS_Console * console,
+    SDL_Renderer * renderer,
+    Uint32 * format,
+    const Uint32 ** colors )
+{
+    if ( console->backend != &dos_surface_backend ) {
+        return NULL;
+    }
+    
+    MatchRenderer(console, renderer);
+    UpdateBlink(console);
+    
+    *format = console->texture_format;
+    *colors = console->indexed ? console->texture_colors : NULL;
+    
+    return console->surface;
+}
+
+void
+DOS_RenderConsoleCursor
+(   SDL_Renderer * renderer,
+    DOS_Console * console,
+    int x,
+    int y,
+    int scale )
+{
+    RenderCursor(renderer, console, x, y, scale);
+}
+
+// Mark the entire surface as needing to be read again.
+void DOS_InvalidateConsole(DOS_Console * console)
+{
+    if ( console->dirty_left == NULL ) {
+        return; // no surface
+    }
+    
+    for ( int y = 0; y < console->height; y++ ) {
+        console->dirty_left[y] = 0;
+        console->dirty_right[y] = console->width;
+    }
+}
+
+/**
+ *  Draw any changed cells, then get the areas of the surface, in pixels, drawn
+ *  to since the last call and mark them clean. `rects` must have room for one
+ *  rect per console row. Returns the number of rects. If someone else
+ *  (`reader`) took the rects last, the whole surface is returned.
+ */
+int DOS_TakeDirtyRects(DOS_Console * console, const void * reader, SDL_Rect * rects)
+{
+    int count = 0;
+    SDL_Rect * last = NULL;
+    
+    FlushStale(console);
+    
+    if ( console->surface == NULL ) {
+        return 0;
+    }
+    
+    if ( reader != console->dirty_reader ) {
+        DOS_InvalidateConsole(console);
+        console->dirty_reader = reader;
+    }
+    
+    for ( int y = 0; y < console->height; y++ ) {
+        int left = console->dirty_left[y];
+        int right = console->dirty_right[y];
+        
+        if ( left >= right ) {
+            continue;
+        }
+        
+        console->dirty_left[y] = console->width;
+        console->dirty_right[y] = 0;
+        
+        SDL_Rect rect;
+        rect.x = left * console->cell_w;
+        rect.y = y * console->cell_h;
+        rect.w = (right - left) * console->cell_w;
+        rect.h = console->cell_h;
+        
+        // extend the previous rect down if it covers the same columns
+        if ( last && last->x == rect.x && last->w == rect.w
+            && last->y + last->h == rect.y ) {
+            last->h += rect.h;
+        } else {
+            rects[count] = rect;
+            last = &rects[count++];
+        }
+    }
+    
+    return count;
+}
+
+/**
+ *  Milliseconds until the console's appearance next changes on its own
+ *  (cursor or text blink), or -1 if it is static.
+ */
+int DOS_ConsoleTimeToChange(DOS_Console * console)
+{
+    Uint32 now = SDL_GetTicks();
+    int time = -1;
+    
+    if ( console->cursor_type != DOS_CURSOR_NONE ) {
+        time = CURSOR_BLINK_MS - now % CURSOR_BLINK_MS;
+    }
+    
+    if ( console->blink_cells > 0 ) {
+        int blink_time = TEXT_BLINK_MS - now % TEXT_BLINK_MS;
+        if ( time == -1 || blink_time < time ) {
+            time = blink_time;
+        }
+    }
+    
+    return time;
+}
+
+// Internal functions for ansi.c.
+
+void ** DOS_ConsoleANSI(DOS_Console * console)
+{
+    return &console->ansi;
+}
+
+void DOS_ConsoleSize(DOS_Console * console, int * w, int * h)
+{
+    *w = console->width;
+    *h = console->height;
+}
+
+// Write characters at x, y in the current colors, without moving the cursor.
+// They must fit in the row.
+void DOS_WriteRow(DOS_Console * console, int x, int y, const uint8_t * chars, int count)
+{
+    DOS_Attributes attributes = { 0 };
+    attributes.fg_color = console->fg_color;
+    attributes.bg_color = console->bg_color;
+    attributes.blink = console->blink;
+    
+    DOS_CharInfo * cells = GetCell(console, x, y);
+    int blink_cells = count * attributes.blink;
     
-    SDL_DestroyTexture(texture);
+    for ( int i = 0; i < count; i++ ) {
+        attributes.transparent = StaysTransparent(&cells[i]);
+        blink_cells -= cells[i].attributes.blink;
+        cells[i].character = chars[i];
+        cells[i].attributes = attributes;
+    }
     
-    RenderCursor(renderer, x, y);
+    console->blink_cells += blink_cells;
+    MarkStale(console, x, x + count, y);
+}
+
+// Blank cells `left` to `right` (exclusive) of row y in the current background.
+void DOS_EraseRow(DOS_Console * console, int y, int left, int right)
+{
+    DOS_Attributes attributes = { 0 };
+    attributes.fg_color = console->fg_color;
+    attributes.bg_color = console->bg_color;
+    
+    DOS_CharInfo * cells = GetCell(console, 0, y);
+    int blink_cells = 0;
+    
+    for ( int x = left; x < right; x++ ) {
+        attributes.transparent = StaysTransparent(&cells[x]);
+        blink_cells -= cells[x].attributes.blink;
+        cells[x].character = ' ';
+        cells[x].attributes = attributes;
+    }
+    
+    console->blink_cells += blink_cells;
+    MarkStale(console, left, right, y);
+}
+
+// Move everything up `lines` rows (down if negative), blanking the rows
+// uncovered. Only the start of the buffer moves; the surface is drawn again.
+void DOS_ScrollConsole(DOS_Console * console, int lines)
+{
+    int h = console->height;
+    
+    if ( lines >= h || lines <= -h ) {
+        for ( int y = 0; y < h; y++ ) {
+            DOS_EraseRow(console, y, 0, console->width);
+        }
+        return;
+    }
+    
+    if ( lines > 0 ) {
+        console->top = (console->top + lines) % h;
+        for ( int y = h - lines; y < h; y++ ) {
+            DOS_EraseRow(console, y, 0, console->width);
+        }
+    } else if ( lines < 0 ) {
+        console->top = (console->top + h + lines) % h;
+        for ( int y = 0; y < -lines; y++ ) {
+            DOS_EraseRow(console, y, 0, console->width);
+        }
+    }
+    
+    MarkAllStale(console);
 }
 
 void DOS_GotoXY(int x, int y)
@@ -347,8 +1290,11 @@ DOS_CharInfo DOS_GetChar()
 
 void DOS_SetChar(DOS_CharInfo * char_info)
 {// TODO: test
-    DOS_CharInfo * cell = GetCell(_current_page, _current_page->cursor_x, _current_page->cursor_y);
-    *cell = *char_info;
+    int x = _current_page->cursor_x;
+    int y = _current_page->cursor_y;
+    
+    ReplaceCell(_current_page, GetCell(_current_page, x, y), *char_info);
+    MarkStale(_current_page, x, x + 1, y);
 }
 
 void DOS_SetBlink(bool blink)
@@ -375,3 +1321,196 @@ void DOS_SetMargin(int margin)
 {
     _current_page->margin = margin;
 }
+
+void DOS_SetFont(DOS_Font * font)
+{
+    if ( font == NULL ) {
+        font = DOS_GetDefaultFont(_current_page->mode);
+    }
+    
+    // (9-pixel cells take 8-pixel fonts, as VGA does)
+    if ( DOS_FontWidth(font) != DOS_CHAR_WIDTH
+        || DOS_FontHeight(font) != _current_page->cell_h ) {
+        fprintf(stderr, "DOS_SetFont: font is %dx%d, console cells are %dx%d\n",
+                DOS_FontWidth(font), DOS_FontHeight(font),
+                _current_page->cell_w, _current_page->cell_h);
+        return;
+    }
+    
+    _current_page->font = font;
+    MarkAllStale(_current_page);
+}
+
+void DOS_SetIndexed(bool indexed)
+{
+    if ( indexed == _current_page->indexed ) {
+        return;
+    }
+    
+    if ( _current_page->surface == NULL ) {
+        _current_page->indexed = indexed; // for when there is one
+        return;
+    }
+    
+    Uint32 format;
+    if ( indexed ) {
+        format = SDL_PIXELFORMAT_INDEX8;
+    } else if ( _current_page->format_renderer ) {
+        format = _current_page->texture_format;
+    } else {
+        format = SDL_PIXELFORMAT_RGBA32;
+    }
+    
+    SetSurfaceFormat(_current_page, format);
+    
+    if ( indexed && _current_page->format_renderer ) {
+        MapTextureColors(_current_page);
+    }
+}
+
+void DOS_SetBackend(const DOS_Backend * backend)
+{
+    if ( backend == _current_page->backend ) {
+        return;
+    }
+    
+    if ( !SetBackend(_current_page, backend) ) {
+        fprintf(stderr, "DOS_SetBackend: could not create backend\n");
+    }
+}
+
+void DOS_CellColors(DOS_Console * console, const DOS_CharInfo * cell, SDL_Color * fg, SDL_Color * bg)
+{
+    *fg = console->palette[cell->attributes.fg_color];
+    *bg = console->palette[cell->attributes.bg_color];
+    
+    if ( cell->attributes.blink && console->blink_hidden ) {
+        *fg = *bg;
+    }
+    
+    if ( cell->attributes.transparent ) {
+        *bg = console->palette[DOS_NUMCOLORS];
+    }
+}
+
+DOS_Font * DOS_GetConsoleFont(DOS_Console * console)
+{
+    return console->font;
+}
+
+void DOS_ResizeConsole(int w, int h)
+{
+    DOS_Console * console = _current_page;
+    
+    if ( w < 1 || h < 1 ) {
+        fprintf(stderr, "DOS_ResizeConsole: bad size %dx%d\n", w, h);
+        return;
+    }
+    
+    DOS_CharInfo * buffer = malloc(w * h * sizeof(*buffer));
+    int * stale_left = malloc(h * sizeof(*stale_left));
+    int * stale_right = malloc(h * sizeof(*stale_right));
+    
+    if ( buffer == NULL || stale_left == NULL || stale_right == NULL ) {
+        fprintf(stderr, "DOS_ResizeConsole: could not allocate buffer\n");
+        free(buffer);
+        free(stale_left);
+        free(stale_right);
+        return;
+    }
+    
+    ClearCells(buffer, (size_t)w * h);
+    
+    // Keep what fits, from the top left, with the rows back in order.
+    int rows = h < console->height ? h : console->height;
+    int columns = w < console->width ? w : console->width;
+    int blink_cells = 0;
+    
+    for ( int y = 0; y < rows; y++ ) {
+        const DOS_CharInfo * row = GetCell(console, 0, y);
+        memcpy(buffer + y * w, row, columns * sizeof(*buffer));
+        
+        for ( int x = 0; x < columns; x++ ) {
+            blink_cells += row[x].attributes.blink;
+        }
+    }
+    
+    free(console->buffer);
+    free(console->stale_left);
+    free(console->stale_right);
+    console->buffer = buffer;
+    console->stale_left = stale_left;
+    console->stale_right = stale_right;
+    console->width = w;
+    console->height = h;
+    console->top = 0;
+    console->blink_cells = blink_cells;
+    
+    if ( console->cursor_x >= w ) {
+        console->cursor_x = w - 1;
+    }
+    
+    if ( console->cursor_y >= h ) {
+        console->cursor_y = h - 1;
+    }
+    
+    if ( console->margin >= w ) {
+        console->margin = 0;
+    }
+    
+    const DOS_Backend * backend = console->backend;
+    
+    if ( backend->resize && !backend->resize(console->backend_state, w, h) ) {
+        fprintf(stderr, "DOS_ResizeConsole: backend could not be resized, "
+                "nothing will be drawn\n");
+        
+        if ( backend->destroy ) {
+            backend->destroy(console->backend_state);
+        }
+        
+        console->backend = &dos_memory_backend;
+        console->backend_state = NULL;
+    }
+    
+    MarkAllStale(console);
+}
+
+void DOS_SetPalette(const SDL_Color * colors, int first, int count)
+{
+    if ( first < 0 || count < 0 || first + count > DOS_NUMCOLORS ) {
+        fprintf(stderr, "DOS_SetPalette: bad color range %d-%d\n", first, first + count - 1);
+        return;
+    }
+    
+    Uint32 changed = 0; // a bit per palette index
+    
+    for ( int i = 0; i < count; i++ ) {
+        SDL_Color * c = &_current_page->palette[first + i];
+        if ( memcmp(c, &colors[i], sizeof(*c)) != 0 ) {
+            *c = colors[i];
+            changed |= 1u << (first + i);
+        }
+    }
+    
+    if ( changed == 0 ) {
+        return;
+    }
+    
+    if ( _current_page->surface == NULL ) {
+        MarkAllStale(_current_page);
+    } else if ( _current_page->indexed ) {
+        // No need to draw anything again: pick up the new colors, and read
+        // again only the rows that use them.
+        MapColors(_current_page);
+        MapTextureColors(_current_page);
+        MarkColorsDirty(_current_page, changed);
+    } else {
+        MapColors(_current_page);
+        MarkAllStale(_current_page);
+    }
+}
+
+void DOS_ResetPalette(void)
+{
+    DOS_SetPalette(dos_palette, 0, DOS_NUMCOLORS);
+}
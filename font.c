@@ -0,0 +1,556 @@
+#include "textmode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define MAP_FONTS 0
+#else
+#define MAP_FONTS 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define PSF1_MAGIC      0x0436
+#define PSF1_MODE512    0x01
+#define PSF2_MAGIC      0x864AB572
+#define MAX_FONT_SIZE   32 // in pixels, either way
+
+struct DOS_Font
+{
+    int             width;      // in pixels
+    int             height;
+    int             row_size;   // bytes per row of a glyph
+    int             count;      // number of glyphs
+    const uint8_t * glyphs;     // points into `data`
+    uint8_t *       masks;      // 8 pixel fonts: each pixel as 0x00 or 0xFF
+
+    void *          data;       // file contents (mapped, or read if not)
+    size_t          data_size;
+    bool            mapped;
+};
+
+// Glyphs drawn white on transparent, for DOS_RenderChar: one texture per
+// font and renderer, built when first needed. The default fonts are shared by
+// every thread, so the table is guarded by `atlas_lock`. A renderer belongs
+// to one thread, so a texture is only destroyed for its own renderer (or by
+// DOS_FreeFont): each renderer keeps up to MAX_ATLASES, and the table grows to
+// hold them all.
+#define MAX_ATLASES 16
+
+typedef struct {
+    const DOS_Font *    font;
+    SDL_Renderer *      renderer;
+    SDL_Texture *       texture;
+    Uint32              last_used;
+} Atlas;
+
+static Atlas * atlases;
+static int num_atlases;
+static Uint32 atlas_clock;
+static SDL_SpinLock atlas_lock;
+
+const uint8_t * DOS_Data8(uint8_t ch);
+const uint8_t * DOS_Data16(uint8_t ch);
+
+#define NUM_DEFAULT_FONTS 3
+
+static DOS_Font default_fonts[NUM_DEFAULT_FONTS] = {
+    { .width = 8, .height = 8, .row_size = 1, .count = 256 },
+    { .width = 8, .height = 14, .row_size = 1, .count = 256 },
+    { .width = 8, .height = 16, .row_size = 1, .count = 256 },
+};
+
+static uint8_t ega_glyphs[256 * 14];
+static uint8_t default_masks[NUM_DEFAULT_FONTS][256 * 16 * 8];
+static SDL_atomic_t default_fonts_ready[NUM_DEFAULT_FONTS];
+static SDL_SpinLock default_fonts_lock;
+
+// Make the 8x14 font from the 8x16 one by dropping two rows from each glyph:
+// the top and bottom rows for line drawing characters, so they still join up,
+// and otherwise whichever rows are blank.
+static const uint8_t * MakeEGAGlyphs(void)
+{
+    for ( int ch = 0; ch < 256; ch++ ) {
+        const uint8_t * data = DOS_Data16(ch);
+        int first = 1;
+
+        if ( ch < 0xB0 || ch > 0xDF ) {
+            if ( data[0] && !data[14] && !data[15] ) {
+                first = 0;
+            } else if ( data[15] && !data[0] && !data[1] ) {
+                first = 2;
+            }
+        }
+
+        memcpy(&ega_glyphs[ch * 14], data + first, 14);
+    }
+
+    return ega_glyphs;
+}
+
+// Expand each row of each glyph into a byte per pixel, so that cells can be
+// drawn by masking rather than testing bits. Only for 8-pixel wide fonts:
+// each row is then 8 bytes.
+static void ExpandMasks(DOS_Font * font)
+{
+    const uint8_t * row = font->glyphs;
+    uint8_t * mask = font->masks;
+
+    for ( int i = 0; i < font->count * font->height; i++, row++ ) {
+        for ( int x = 0; x < 8; x++ ) {
+            *mask++ = -((*row >> (7 - x)) & 1);
+        }
+    }
+}
+
+DOS_Font * DOS_GetDefaultFont(DOS_Mode mode)
+{
+    int i;
+
+    switch ( DOS_CharHeight(mode) ) {
+        case 8: i = 0; break;
+        case 14: i = 1; break;
+        default: i = 2; break;
+    }
+
+    DOS_Font * font = &default_fonts[i];
+
+    // Set up once, by whichever thread asks first.
+    if ( SDL_AtomicGet(&default_fonts_ready[i]) ) {
+        return font;
+    }
+
+    SDL_AtomicLock(&default_fonts_lock);
+
+    if ( !SDL_AtomicGet(&default_fonts_ready[i]) ) {
+        switch ( i ) {
+            case 0: font->glyphs = DOS_Data8(0); break;
+            case 1: font->glyphs = MakeEGAGlyphs(); break;
+            default: font->glyphs = DOS_Data16(0); break;
+        }
+
+        font->masks = default_masks[i];
+        ExpandMasks(font);
+        SDL_AtomicSet(&default_fonts_ready[i], 1);
+    }
+
+    SDL_AtomicUnlock(&default_fonts_lock);
+
+    return font;
+}
+
+int DOS_FontWidth(const DOS_Font * font)
+{
+    return font->width;
+}
+
+int DOS_FontHeight(const DOS_Font * font)
+{
+    return font->height;
+}
+
+// The bitmap for a character: one row after another, each `row_size` bytes,
+// most significant bit leftmost.
+static const uint8_t * GetGlyph(const DOS_Font * font, uint8_t ch)
+{
+    if ( ch >= font->count ) {
+        ch = 0;
+    }
+
+    return font->glyphs + ch * font->height * font->row_size;
+}
+
+// The expanded character: 8 bytes per row, 0xFF where the pixel is set. NULL
+// if the font is not 8 pixels wide. (Used by console.c.)
+const uint8_t * DOS_FontMask(const DOS_Font * font, uint8_t ch)
+{
+    if ( font->masks == NULL ) {
+        return NULL;
+    }
+
+    if ( ch >= font->count ) {
+        ch = 0;
+    }
+
+    return font->masks + ch * font->height * 8;
+}
+
+static Uint32 ReadLittleEndian(const uint8_t * bytes)
+{
+    return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (Uint32)bytes[3] << 24;
+}
+
+// Read the whole file, by mapping it if possible.
+static bool ReadFontFile(DOS_Font * font, const char * path)
+{
+#if MAP_FONTS
+    int fd = open(path, O_RDONLY);
+    if ( fd == -1 ) {
+        return false;
+    }
+
+    struct stat info;
+    if ( fstat(fd, &info) == -1 || info.st_size == 0 ) {
+        close(fd);
+        return false;
+    }
+
+    void * data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // (the mapping stays)
+
+    if ( data == MAP_FAILED ) {
+        return false;
+    }
+
+    font->data = data;
+    font->data_size = info.st_size;
+    font->mapped = true;
+
+    return true;
+#else
+    FILE * file = fopen(path, "rb");
+    if ( file == NULL ) {
+        return false;
+    }
+
+    long size = -1;
+    if ( fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0 ) {
+        rewind(file);
+        font->data = malloc(size);
+    }
+
+    if ( font->data == NULL || fread(font->data, 1, size, file) != (size_t)size ) {
+        free(font->data);
+        font->data = NULL;
+        fclose(file);
+        return false;
+    }
+
+    fclose(file);
+    font->data_size = size;
+    font->mapped = false;
+
+    return true;
+#endif
+}
+
+// Find the glyphs in a PSF1, PSF2, or raw (256 8xN glyphs) font.
+static const char * ParseFont(DOS_Font * font)
+{
+    const uint8_t * data = font->data;
+    size_t size = font->data_size;
+    size_t header_size;
+
+    if ( size >= 32 && ReadLittleEndian(data) == PSF2_MAGIC ) {
+        header_size = ReadLittleEndian(data + 8);
+        font->count = ReadLittleEndian(data + 16);
+        font->height = ReadLittleEndian(data + 24);
+        font->width = ReadLittleEndian(data + 28);
+        font->row_size = (font->width + 7) / 8;
+
+        if ( ReadLittleEndian(data + 20) != (Uint32)(font->height * font->row_size) ) {
+            return "bad PSF2 glyph size";
+        }
+    } else if ( size >= 4 && (data[0] | data[1] << 8) == PSF1_MAGIC ) {
+        header_size = 4;
+        font->count = data[2] & PSF1_MODE512 ? 512 : 256;
+        font->height = data[3];
+        font->width = 8;
+        font->row_size = 1;
+    } else if ( size % 256 == 0 ) {
+        header_size = 0;
+        font->count = 256;
+        font->height = (int)(size / 256);
+        font->width = 8;
+        font->row_size = 1;
+    } else {
+        return "unrecognized format";
+    }
+
+    if ( font->width < 1 || font->width > MAX_FONT_SIZE
+        || font->height < 1 || font->height > MAX_FONT_SIZE ) {
+        return "unsupported glyph size";
+    }
+
+    if ( font->count < 1
+        || header_size > size
+        || (size - header_size) / ((size_t)font->height * font->row_size) < (size_t)font->count ) {
+        return "file is too short";
+    }
+
+    font->glyphs = data + header_size;
+
+    return NULL;
+}
+
+DOS_Font * DOS_LoadFont(const char * path)
+{
+    DOS_Font * font = calloc(1, sizeof(*font));
+
+    if ( font == NULL ) {
+        fprintf(stderr, "DOS_LoadFont: could not allocate memory for font\n");
+        return NULL;
+    }
+
+    if ( !ReadFontFile(font, path) ) {
+        fprintf(stderr, "DOS_LoadFont: could not read '%s'\n", path);
+        free(font);
+        return NULL;
+    }
+
+    const char * error = ParseFont(font);
+
+    if ( error ) {
+        fprintf(stderr, "DOS_LoadFont: '%s': %s\n", path, error);
+        DOS_FreeFont(font);
+        return NULL;
+    }
+
+    if ( font->width == 8 ) {
+        font->masks = malloc((size_t)font->count * font->height * 8);
+
+        if ( font->masks == NULL ) {
+            fprintf(stderr, "DOS_LoadFont: could not allocate memory for '%s'\n", path);
+            DOS_FreeFont(font);
+            return NULL;
+        }
+
+        ExpandMasks(font);
+    }
+
+    return font;
+}
+
+void DOS_FreeFont(DOS_Font * font)
+{
+    if ( font == NULL
+        || (font >= default_fonts && font < default_fonts + NUM_DEFAULT_FONTS) ) {
+        return;
+    }
+
+    SDL_AtomicLock(&atlas_lock);
+    for ( int i = 0; i < num_atlases; i++ ) {
+        if ( atlases[i].font == font ) {
+            SDL_DestroyTexture(atlases[i].texture);
+            atlases[i] = (Atlas){ 0 };
+        }
+    }
+    SDL_AtomicUnlock(&atlas_lock);
+
+    free(font->masks);
+
+#if MAP_FONTS
+    if ( font->mapped ) {
+        munmap(font->data, font->data_size);
+    }
+#else
+    free(font->data);
+#endif
+
+    free(font);
+}
+
+void DOS_FreeFontTextures(SDL_Renderer * renderer)
+{
+    SDL_AtomicLock(&atlas_lock);
+    for ( int i = 0; i < num_atlases; i++ ) {
+        if ( atlases[i].renderer == renderer ) {
+            SDL_DestroyTexture(atlases[i].texture);
+            atlases[i] = (Atlas){ 0 };
+        }
+    }
+    SDL_AtomicUnlock(&atlas_lock);
+}
+
+// Glyphs are laid out in 16 rows of 16.
+static SDL_Texture * MakeAtlas(const DOS_Font * font, SDL_Renderer * renderer)
+{
+    int count = font->count < 256 ? font->count : 256;
+    SDL_Surface * surface;
+    surface = SDL_CreateRGBSurfaceWithFormat(0,
+                                             font->width * 16,
+                                             font->height * 16,
+                                             32,
+                                             SDL_PIXELFORMAT_ARGB8888);
+    if ( surface == NULL ) {
+        return NULL;
+    }
+
+    SDL_FillRect(surface, NULL, 0);
+
+    for ( int ch = 0; ch < count; ch++ ) {
+        const uint8_t * data = GetGlyph(font, ch);
+        Uint8 * row = (Uint8 *)surface->pixels
+            + (ch / 16) * font->height * surface->pitch
+            + (ch % 16) * font->width * 4;
+
+        for ( int y = 0; y < font->height; y++, data += font->row_size ) {
+            Uint32 * pixel = (Uint32 *)(row + y * surface->pitch);
+            for ( int x = 0; x < font->width; x++ ) {
+                if ( data[x / 8] & (0x80 >> (x % 8)) ) {
+                    pixel[x] = 0xFFFFFFFF;
+                }
+            }
+        }
+    }
+
+    SDL_Texture * texture = SDL_CreateTextureFromSurface(renderer, surface);
+    SDL_FreeSurface(surface);
+
+    if ( texture ) {
+        SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+    }
+
+    return texture;
+}
+
+// Must be called with `atlas_lock` held.
+static Atlas * FindAtlas(const DOS_Font * font, SDL_Renderer * renderer)
+{
+    for ( int i = 0; i < num_atlases; i++ ) {
+        if ( atlases[i].font == font && atlases[i].renderer == renderer ) {
+            atlases[i].last_used = ++atlas_clock;
+            return &atlases[i];
+        }
+    }
+
+    return NULL;
+}
+
+// The slot for a new atlas: an empty one, else this renderer's least recently
+// used if it has MAX_ATLASES, else a new one. Another renderer's atlas is
+// never evicted, as another thread may be drawing with it. Returns NULL if
+// the table can't grow. Must be called with `atlas_lock` held.
+static Atlas * FreeAtlasSlot(SDL_Renderer * renderer)
+{
+    Atlas * oldest = NULL;
+    int own = 0;
+
+    for ( int i = 0; i < num_atlases; i++ ) {
+        Atlas * atlas = &atlases[i];
+
+        if ( atlas->texture == NULL ) {
+            return atlas;
+        }
+
+        if ( atlas->renderer == renderer ) {
+            own++;
+            if ( oldest == NULL
+                || atlas_clock - atlas->last_used > atlas_clock - oldest->last_used ) {
+                oldest = atlas;
+            }
+        }
+    }
+
+    if ( own >= MAX_ATLASES ) {
+        SDL_DestroyTexture(oldest->texture);
+        *oldest = (Atlas){ 0 };
+        return oldest;
+    }
+
+    Atlas * grown = realloc(atlases, (num_atlases + 1) * sizeof(*grown));
+    if ( grown == NULL ) {
+        return NULL;
+    }
+
+    atlases = grown;
+    atlases[num_atlases] = (Atlas){ 0 };
+
+    return &atlases[num_atlases++];
+}
+
+static SDL_Texture * GetAtlas(const DOS_Font * font, SDL_Renderer * renderer)
+{
+    SDL_AtomicLock(&atlas_lock);
+    Atlas * atlas = FindAtlas(font, renderer);
+    SDL_Texture * texture = atlas ? atlas->texture : NULL;
+    SDL_AtomicUnlock(&atlas_lock);
+
+    if ( texture ) {
+        return texture;
+    }
+
+    // Built without the lock: it takes a while.
+    texture = MakeAtlas(font, renderer);
+    if ( texture == NULL ) {
+        return NULL;
+    }
+
+    SDL_AtomicLock(&atlas_lock);
+    atlas = FindAtlas(font, renderer);
+
+    if ( atlas ) { // made meanwhile
+        SDL_DestroyTexture(texture);
+        texture = atlas->texture;
+    } else if ( (atlas = FreeAtlasSlot(renderer)) != NULL ) {
+        atlas->font = font;
+        atlas->renderer = renderer;
+        atlas->texture = texture;
+        atlas->last_used = ++atlas_clock;
+    } else {
+        fprintf(stderr, "%s: out of memory\n", __func__);
+        SDL_DestroyTexture(texture);
+        texture = NULL;
+    }
+    SDL_AtomicUnlock(&atlas_lock);
+
+    return texture;
+}
+
+// Draw a character in a cell `cell_width` wide. Line drawing characters
+// are extended into any extra columns on the right, as in VGA text mode.
+// (Used by text.c.)
+void
+DOS_RenderCharCell
+(   SDL_Renderer * renderer,
+    int x,
+    int y,
+    DOS_Font * font,
+    int cell_width,
+    uint8_t character )
+{
+    SDL_Texture * atlas = GetAtlas(font, renderer);
+
+    if ( atlas == NULL ) {
+        return;
+    }
+
+    // draw in the renderer's current color
+    Uint8 r, g, b, a;
+    SDL_GetRenderDrawColor(renderer, &r, &g, &b, &a);
+    SDL_SetTextureColorMod(atlas, r, g, b);
+    SDL_SetTextureAlphaMod(atlas, a);
+
+    SDL_Rect src = {
+        (character % 16) * font->width,
+        (character / 16) * font->height,
+        font->width,
+        font->height
+    };
+    SDL_Rect dst = { x, y, font->width, font->height };
+
+    SDL_RenderCopy(renderer, atlas, &src, &dst);
+
+    if ( cell_width > font->width && character >= 0xC0 && character <= 0xDF ) {
+        src.x += font->width - 1;
+        src.w = 1;
+        dst.x += font->width;
+        dst.w = cell_width - font->width;
+        SDL_RenderCopy(renderer, atlas, &src, &dst);
+    }
+}
+
+void
+DOS_RenderCharFont
+(   SDL_Renderer * renderer,
+    int x,
+    int y,
+    DOS_Font * font,
+    uint8_t character )
+{
+    DOS_RenderCharCell(renderer, x, y, font, font->width, character);
+}
@@ -0,0 +1,298 @@
+#include "textmode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// dos_geometry_backend: consoles drawn as a batch of triangles rather than
+// from a surface. Each cell is two quads, background then glyph, textured from
+// an atlas of the font with the colors set per vertex, so the whole console is
+// a single SDL_RenderGeometry call. Vertices are only rewritten for cells that
+// change.
+
+#define VERTS_PER_CELL      8
+#define INDICES_PER_CELL    12
+#define SOLID_CELL          256 // atlas cell that is all white, for backgrounds
+
+typedef struct
+{
+    DOS_Console *   console;
+    int             width;      // in cells
+    int             height;
+    int             cell_w;     // in pixels
+    int             cell_h;
+    SDL_Vertex *    vertices;   // VERTS_PER_CELL per cell
+    int *           indices;
+
+    SDL_Rect        placed;     // where the vertices were last placed
+
+    // glyphs drawn white on transparent, 16 per row, then SOLID_CELL
+    SDL_Texture *   atlas;
+    SDL_Renderer *  atlas_renderer;
+    const DOS_Font * atlas_font;
+    int             atlas_w;
+    int             atlas_h;
+} Geometry;
+
+const uint8_t * DOS_FontMask(const DOS_Font * font, uint8_t ch);
+
+// Set a quad's texture coordinates to atlas cell `index`.
+static void SetTexCoords(const Geometry * g, SDL_Vertex * quad, int index)
+{
+    float left = (float)(index % 16 * g->cell_w) / g->atlas_w;
+    float top = (float)(index / 16 * g->cell_h) / g->atlas_h;
+    float right = left + (float)g->cell_w / g->atlas_w;
+    float bottom = top + (float)g->cell_h / g->atlas_h;
+
+    if ( index == SOLID_CELL ) { // any texel will do: keep clear of the edges
+        left = right = (left + right) / 2;
+        top = bottom = (top + bottom) / 2;
+    }
+
+    quad[0].tex_coord = (SDL_FPoint){ left, top };
+    quad[1].tex_coord = (SDL_FPoint){ right, top };
+    quad[2].tex_coord = (SDL_FPoint){ left, bottom };
+    quad[3].tex_coord = (SDL_FPoint){ right, bottom };
+}
+
+// (Re)allocate the vertices and indices for w x h cells.
+static bool Allocate(Geometry * g, int w, int h)
+{
+    free(g->vertices);
+    free(g->indices);
+
+    g->width = w;
+    g->height = h;
+    g->vertices = calloc((size_t)w * h * VERTS_PER_CELL, sizeof(*g->vertices));
+    g->indices = malloc((size_t)w * h * INDICES_PER_CELL * sizeof(*g->indices));
+    g->placed = (SDL_Rect){ 0 };
+
+    if ( g->vertices == NULL || g->indices == NULL ) {
+        free(g->vertices);
+        free(g->indices);
+        g->vertices = NULL;
+        g->indices = NULL;
+        return false;
+    }
+
+    // Two triangles per quad, background first so the glyph is drawn over it.
+    static const int quad[INDICES_PER_CELL] = { 0, 1, 2, 2, 1, 3, 4, 5, 6, 6, 5, 7 };
+
+    for ( int i = 0; i < w * h; i++ ) {
+        for ( int j = 0; j < INDICES_PER_CELL; j++ ) {
+            g->indices[i * INDICES_PER_CELL + j] = i * VERTS_PER_CELL + quad[j];
+        }
+
+        SetTexCoords(g, &g->vertices[i * VERTS_PER_CELL], SOLID_CELL);
+        SetTexCoords(g, &g->vertices[i * VERTS_PER_CELL + 4], ' ');
+    }
+
+    return true;
+}
+
+static void * Create(DOS_Console * console, int w, int h, int cell_w, int cell_h)
+{
+    Geometry * g = calloc(1, sizeof(*g));
+
+    if ( g == NULL ) {
+        return NULL;
+    }
+
+    g->console = console;
+    g->cell_w = cell_w;
+    g->cell_h = cell_h;
+    g->atlas_w = 16 * cell_w;
+    g->atlas_h = 17 * cell_h;
+
+    if ( !Allocate(g, w, h) ) {
+        free(g);
+        return NULL;
+    }
+
+    return g;
+}
+
+static void Destroy(void * state)
+{
+    Geometry * g = state;
+
+    if ( g->atlas ) {
+        SDL_DestroyTexture(g->atlas);
+    }
+
+    free(g->vertices);
+    free(g->indices);
+    free(g);
+}
+
+// Set the character and colors of the cell at x, y.
+static void SetCell(Geometry * g, int x, int y, uint8_t ch, SDL_Color fg, SDL_Color bg)
+{
+    SDL_Vertex * v = &g->vertices[(y * g->width + x) * VERTS_PER_CELL];
+
+    for ( int i = 0; i < 4; i++ ) {
+        v[i].color = bg;
+        v[i + 4].color = fg;
+    }
+
+    SetTexCoords(g, v + 4, ch);
+}
+
+static void UpdateCells(void * state, int x, int y, const DOS_CharInfo * cells, int count)
+{
+    Geometry * g = state;
+    SDL_Color fg, bg;
+
+    for ( int i = 0; i < count; i++ ) {
+        DOS_CellColors(g->console, &cells[i], &fg, &bg);
+        SetCell(g, x + i, y, cells[i].character, fg, bg);
+    }
+}
+
+static void Clear(void * state)
+{
+    Geometry * g = state;
+    DOS_CharInfo blank = { .character = ' ', .attributes.transparent = 1 };
+    SDL_Color fg, bg;
+
+    DOS_CellColors(g->console, &blank, &fg, &bg);
+
+    for ( int y = 0; y < g->height; y++ ) {
+        for ( int x = 0; x < g->width; x++ ) {
+            SetCell(g, x, y, ' ', bg, bg);
+        }
+    }
+}
+
+static bool Resize(void * state, int w, int h)
+{
+    return Allocate(state, w, h);
+}
+
+// Build the atlas from the font's masks. Line drawing characters have their
+// last column repeated into any extra columns, as in DOS_RenderCharCell.
+static bool MakeAtlas(Geometry * g, SDL_Renderer * renderer, const DOS_Font * font)
+{
+    if ( g->atlas ) {
+        SDL_DestroyTexture(g->atlas);
+        g->atlas = NULL;
+    }
+
+    SDL_Surface * surface;
+    surface = SDL_CreateRGBSurfaceWithFormat(0, g->atlas_w, g->atlas_h, 32, SDL_PIXELFORMAT_ARGB8888);
+
+    if ( surface == NULL ) {
+        return false;
+    }
+
+    SDL_FillRect(surface, NULL, 0);
+
+    for ( int ch = 0; ch < 256; ch++ ) {
+        const uint8_t * mask = DOS_FontMask(font, ch);
+        bool line = ch >= 0xC0 && ch <= 0xDF;
+        Uint8 * row = (Uint8 *)surface->pixels
+            + (ch / 16) * g->cell_h * surface->pitch
+            + (ch % 16) * g->cell_w * 4;
+
+        for ( int y = 0; y < g->cell_h; y++, mask += 8, row += surface->pitch ) {
+            Uint32 * pixel = (Uint32 *)row;
+            for ( int x = 0; x < g->cell_w; x++ ) {
+                uint8_t set = x < 8 ? mask[x] : line ? mask[7] : 0;
+                pixel[x] = set ? 0xFFFFFFFF : 0;
+            }
+        }
+    }
+
+    SDL_Rect solid = {
+        SOLID_CELL % 16 * g->cell_w,
+        SOLID_CELL / 16 * g->cell_h,
+        g->cell_w,
+        g->cell_h
+    };
+    SDL_FillRect(surface, &solid, 0xFFFFFFFF);
+
+    g->atlas = SDL_CreateTextureFromSurface(renderer, surface);
+    SDL_FreeSurface(surface);
+
+    if ( g->atlas == NULL ) {
+        fprintf(stderr, "could not create console atlas (%s)\n", SDL_GetError());
+        return false;
+    }
+
+    SDL_SetTextureBlendMode(g->atlas, SDL_BLENDMODE_BLEND);
+    g->atlas_renderer = renderer;
+    g->atlas_font = font;
+
+    return true;
+}
+
+// Position every cell's quads to fill `dst`.
+static void PlaceCells(Geometry * g, const SDL_Rect * dst)
+{
+    float w = (float)dst->w / g->width;
+    float h = (float)dst->h / g->height;
+    SDL_Vertex * v = g->vertices;
+
+    for ( int row = 0; row < g->height; row++ ) {
+        float top = (float)dst->y + row * h;
+
+        for ( int col = 0; col < g->width; col++, v += VERTS_PER_CELL ) {
+            float left = (float)dst->x + col * w;
+
+            for ( int i = 0; i < VERTS_PER_CELL; i++ ) {
+                v[i].position.x = i & 1 ? left + w : left;
+                v[i].position.y = i & 2 ? top + h : top;
+            }
+        }
+    }
+
+    g->placed = *dst;
+}
+
+static bool BeginFrame(void * state, SDL_Renderer * renderer)
+{
+    Geometry * g = state;
+    const DOS_Font * font = DOS_GetConsoleFont(g->console);
+
+    if ( renderer == NULL ) {
+        return true;
+    }
+
+    if ( g->atlas && g->atlas_renderer == renderer && g->atlas_font == font ) {
+        return true;
+    }
+
+    return MakeAtlas(g, renderer, font);
+}
+
+static bool Present(void * state, SDL_Renderer * renderer, const SDL_Rect * dst)
+{
+    Geometry * g = state;
+
+    if ( renderer == NULL ) {
+        return true;
+    }
+
+    if ( !SDL_RectEquals(dst, &g->placed) ) {
+        PlaceCells(g, dst);
+    }
+
+    int cells = g->width * g->height;
+
+    // (fails if the renderer doesn't support geometry)
+    return SDL_RenderGeometry(renderer,
+                              g->atlas,
+                              g->vertices,
+                              cells * VERTS_PER_CELL,
+                              g->indices,
+                              cells * INDICES_PER_CELL) == 0;
+}
+
+const DOS_Backend dos_geometry_backend = {
+    .create         = Create,
+    .destroy        = Destroy,
+    .begin_frame    = BeginFrame,
+    .update_cells   = UpdateCells,
+    .present        = Present,
+    .resize         = Resize,
+    .clear          = Clear,
+};
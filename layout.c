@@ -0,0 +1,276 @@
+#include "textmode.h"
+#include <stdio.h>
+
+#define LAYOUT_CACHE_SIZE   32  // number of layouts
+#define LAYOUT_CACHE_LINES  64  // taller boxes are not cached
+
+typedef struct
+{
+    size_t  start;
+    int     length;
+} Line;
+
+typedef struct
+{
+    Uint32          key; // 0 if unused
+    size_t          length;
+#ifndef NDEBUG
+    Uint32          hash; // of the text, see HashText
+#endif
+    int             w;
+    int             h;
+    Uint32          last_used;
+    DOS_TextExtents extents;
+    int             num_lines; // visible lines (up to h)
+    Line            lines[LAYOUT_CACHE_LINES];
+} CachedLayout;
+
+// per thread, as are consoles
+static _Thread_local CachedLayout cache[LAYOUT_CACHE_SIZE];
+static _Thread_local Uint32 cache_time;
+
+extern _Thread_local DOS_Console * _current_page;
+
+void DOS_ConsoleSize(DOS_Console * console, int * w, int * h);
+void DOS_WriteRow(DOS_Console * console, int x, int y, const uint8_t * chars, int count);
+
+// Find the line starting at `*pos` and move `*pos` to the start of the next.
+// Returns false at the end of the text.
+static bool NextLine(const uint8_t * text, size_t length, int width, size_t * pos, Line * line)
+{
+    size_t start = *pos;
+
+    if ( start >= length || width <= 0 ) {
+        return false;
+    }
+
+    size_t i = start;
+    size_t space = start; // last break opportunity, if after start
+
+    while ( i < length && text[i] != '\n' ) {
+        if ( i - start == (size_t)width ) {
+            // Full: break at this or the last space, or else mid-word.
+            size_t end = text[i] == ' ' ? i : space > start ? space : i;
+            size_t next = end;
+
+            while ( end > start && text[end - 1] == ' ' ) {
+                end--;
+            }
+
+            while ( next < length && text[next] == ' ' ) {
+                next++;
+            }
+
+            if ( next > end && next < length && text[next] == '\n' ) {
+                next++; // the line was going to end here anyway
+            }
+
+            line->start = start;
+            line->length = (int)(end - start);
+            *pos = next;
+
+            return true;
+        }
+
+        if ( text[i] == ' ' ) {
+            space = i;
+        }
+
+        i++;
+    }
+
+    line->start = start;
+    line->length = (int)(i - start);
+    *pos = i < length ? i + 1 : i;
+
+    return true;
+}
+
+// Lay out all the text, storing up to `max_lines` lines.
+static void Layout
+(   const uint8_t * text,
+    size_t length,
+    int width,
+    Line * lines,
+    int max_lines,
+    DOS_TextExtents * extents )
+{
+    size_t pos = 0;
+    Line line;
+
+    extents->lines = 0;
+    extents->width = 0;
+
+    while ( NextLine(text, length, width, &pos, &line) ) {
+        if ( extents->lines < max_lines ) {
+            lines[extents->lines] = line;
+        }
+
+        if ( line.length > extents->width ) {
+            extents->width = line.length;
+        }
+
+        extents->lines++;
+    }
+}
+
+#ifndef NDEBUG
+// FNV-1a, a word at a time: much cheaper than laying the text out again. Only
+// used to catch text changed without changing its key, in debug builds: a
+// collision would go unnoticed, so it can't stand in for the key.
+static Uint32 HashText(const uint8_t * text, size_t length)
+{
+    Uint64 hash = 14695981039346656037u;
+    size_t i = 0;
+
+    for ( ; i + 8 <= length; i += 8 ) {
+        Uint64 word;
+        memcpy(&word, text + i, 8);
+        hash = (hash ^ word) * 1099511628211u;
+        hash ^= hash >> 32; // (multiplying only carries upward)
+    }
+
+    for ( ; i < length; i++ ) {
+        hash = (hash ^ text[i]) * 1099511628211u;
+    }
+
+    return (Uint32)(hash ^ hash >> 32);
+}
+#endif
+
+static CachedLayout * GetCachedLayout(const DOS_TextBox * box, const uint8_t * text, size_t length)
+{
+    CachedLayout * entry = NULL;
+    CachedLayout * oldest = &cache[0];
+
+    for ( int i = 0; i < LAYOUT_CACHE_SIZE; i++ ) {
+        if ( cache[i].key == box->key ) {
+            entry = &cache[i];
+            break;
+        }
+
+        if ( cache[i].last_used < oldest->last_used ) {
+            oldest = &cache[i];
+        }
+    }
+
+#ifndef NDEBUG
+    Uint32 hash = HashText(text, length);
+
+    if ( entry && entry->length == length && entry->hash != hash ) {
+        fprintf(stderr, "text changed under layout key %u: use a new key\n", box->key);
+        entry->length = (size_t)-1; // lay it out again
+    }
+#endif
+
+    if ( entry == NULL
+        || entry->length != length
+        || entry->w != box->w
+        || entry->h != box->h ) {
+        if ( entry == NULL ) {
+            entry = oldest;
+        }
+
+        entry->key = box->key;
+        entry->length = length;
+#ifndef NDEBUG
+        entry->hash = hash;
+#endif
+        entry->w = box->w;
+        entry->h = box->h;
+        Layout(text, length, box->w, entry->lines, box->h, &entry->extents);
+        entry->num_lines = entry->extents.lines < box->h ? entry->extents.lines : box->h;
+    }
+
+    entry->last_used = ++cache_time;
+
+    return entry;
+}
+
+// Print a line on row `row` of the box, clipped to the console.
+static void PrintLine(const DOS_TextBox * box, int row, const uint8_t * text, const Line * line)
+{
+    int w, h;
+    DOS_ConsoleSize(_current_page, &w, &h);
+
+    int y = box->y + row;
+
+    if ( y < 0 || y >= h ) {
+        return;
+    }
+
+    int x = box->x;
+
+    switch ( box->align ) {
+        case DOS_ALIGN_CENTER:
+            x += (box->w - line->length) / 2;
+            break;
+        case DOS_ALIGN_RIGHT:
+            x += box->w - line->length;
+            break;
+        default:
+            break;
+    }
+
+    const uint8_t * chars = text + line->start;
+    int count = line->length;
+
+    if ( x < 0 ) {
+        chars -= x;
+        count += x;
+        x = 0;
+    }
+
+    if ( x + count > w ) {
+        count = w - x;
+    }
+
+    if ( count > 0 ) {
+        DOS_WriteRow(_current_page, x, y, chars, count);
+    }
+}
+
+int DOS_PrintText(const DOS_TextBox * box, const char * text, size_t length)
+{
+    const uint8_t * bytes = (const uint8_t *)text;
+
+    if ( box->w <= 0 || box->h <= 0 ) {
+        return 0;
+    }
+
+    if ( box->key != 0 && box->h <= LAYOUT_CACHE_LINES ) {
+        CachedLayout * layout = GetCachedLayout(box, bytes, length);
+
+        for ( int i = 0; i < layout->num_lines; i++ ) {
+            PrintLine(box, i, bytes, &layout->lines[i]);
+        }
+
+        return layout->num_lines;
+    }
+
+    size_t pos = 0;
+    Line line;
+    int row = 0;
+
+    while ( row < box->h && NextLine(bytes, length, box->w, &pos, &line) ) {
+        PrintLine(box, row++, bytes, &line);
+    }
+
+    return row;
+}
+
+void
+DOS_MeasureText
+(   const DOS_TextBox * box,
+    const char * text,
+    size_t length,
+    DOS_TextExtents * extents )
+{
+    const uint8_t * bytes = (const uint8_t *)text;
+
+    if ( box->key != 0 && box->h > 0 && box->h <= LAYOUT_CACHE_LINES ) {
+        *extents = GetCachedLayout(box, bytes, length)->extents;
+    } else {
+        Layout(bytes, length, box->w, NULL, 0, extents);
+    }
+}
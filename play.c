@@ -0,0 +1,689 @@
+#include "textmode.h"
+#include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// PLAY strings
+
+// L[1,2,4,8,16,32,64] default: 4
+// O[0...6] default: 4
+// T[32...255] default: 120
+
+// [A...G]([+,#,-][1,2,4,8,16,32,64][.])
+// N[0...84](.)
+// P[v]
+// |    loop point (music only)
+// ![0...]  marker
+
+typedef struct
+{
+    Uint16  frequency; // 0 for silence
+    Uint32  milliseconds;
+    int     note; // index of the note it's part of
+    int     tag;  // if not -1, this is a marker
+} PlayEvent;
+
+struct DOS_CompiledPlay
+{
+    int         count;
+    PlayEvent   events[];
+};
+
+typedef enum
+{
+    mode_staccato = 6,  // 6/8
+    mode_normal = 7,    // 7/8
+    mode_legato = 8     // 8/8
+} Articulation;
+
+// Parse state, kept between notes.
+typedef struct
+{
+    const char *    string;
+    const char *    str; // next character to parse
+    int             bmp;
+    int             oct;
+    int             len;
+    Articulation    mode;
+    int             notes; // number parsed so far
+    
+    const char *    error;
+    int             error_position;
+} PlayParser;
+
+typedef enum
+{
+    parse_error = -1,
+    parse_end,
+    parse_note,
+    parse_loop_point,
+    parse_marker,
+} ParseResult;
+
+// A parsed note: a pitch followed by the silence before the next note. (Or
+// just `index` and `tag`, for a marker.)
+typedef struct
+{
+    unsigned    frequency;
+    int         note_ms;
+    int         silence_ms;
+    int         index; // of the note, or the next note, for a marker
+    int         tag;
+} PlayNote;
+
+static unsigned NoteNumberToFrequency(int note_num)
+{
+    static const int frequencies[] = { // in octave 6
+        4186, // C
+        4435, // C#
+        4699, // D
+        4978, // D#
+        5274, // E
+        5588, // F
+        5920, // F#
+        6272, // G
+        6645, // G#
+        7040, // A
+        7459, // A#
+        7902, // B
+    };
+
+    if ( note_num == 0 ) { // pause
+        return 0;
+    }
+
+    int octave = (note_num - 1) / 12;
+    int note = (note_num - 1) % 12;
+    int freq = frequencies[note];
+
+    int octaves_down = 6 - octave;
+    while ( octaves_down-- )
+        freq /= 2;
+
+    return freq * 2; // basic notes sound 1 octave higher
+}
+
+static void StartParser(PlayParser * parser, const char * string)
+{
+    parser->string = string;
+    parser->str = string;
+    
+    // default settings
+    parser->bmp = 120;
+    parser->oct = 4;
+    parser->len = 4;
+    parser->mode = mode_normal;
+    parser->notes = 0;
+    
+    parser->error = NULL;
+    parser->error_position = 0;
+}
+
+static ParseResult ParseError(PlayParser * parser, const char * message)
+{
+    parser->error = message;
+    parser->error_position = (int)(parser->str - parser->string);
+    
+    return parse_error;
+}
+
+// Parse up to and including the next note or loop point.
+//
+// TODO: handle tuplet handling
+// TODO: nice if more articulate choice beyond s, n, and l - specify fraction?
+static ParseResult ParseNote(PlayParser * parser, PlayNote * out)
+{
+    // A-G
+    static const int note_offsets[7] = { 9, 11, 0, 2, 4, 5, 7 };
+
+    while ( *parser->str != '\0') {
+        char c = toupper(*parser->str++);
+        switch ( c ) {
+            case 'A': case 'B': case 'C': case 'D': case 'E': case 'F':
+            case 'G': case 'N': case 'P':
+            {
+                // get note:
+                int note = 0;
+                switch ( c ) {
+                    case 'A': case 'B': case 'C': case 'D': case 'E': case 'F':
+                    case 'G':
+                        note = 1 + (parser->oct) * 12 + note_offsets[c - 'A'];
+                        break;
+                    case 'P':
+                        note = 0;
+                        break;
+                    case 'N': {
+                        int number = (int)strtol(parser->str, (char **)&parser->str, 10);
+                        if ( number < 0 || number > 84 )
+                            return ParseError(parser, "bad note number");
+                        if ( number > 0 )
+                            note = number;
+                        break;
+                    }
+                    default:
+                        break;
+                }
+
+                // adjust note per accidental:
+                if ( c >= 'A' && c <= 'G' ) {
+                    if ( *parser->str == '+' || *parser->str == '#' ) {
+                        if ( note < 84 )
+                            note++;
+                        parser->str++;
+                    } else if ( *parser->str == '-' ) {
+                        if ( note > 1 )
+                            note--;
+                        parser->str++;
+                    }
+                }
+
+                int d = parser->len;
+
+                // check if there's a note length following a note A-G, set d
+                if ( c != 'N' ) {
+                    int number = (int)strtol(parser->str, (char **)&parser->str, 10);
+                    
+                    // strtol got a number, but it was a bad one
+                    if ( number < 0 || number > 64 )
+                        return ParseError(parser, "bad note value");
+                    
+                    // strtol found a value number
+                    if ( number > 0 )
+                        d = number;
+                }
+
+                // TODO: this should only happen when after a note length
+                // count dots:
+                int dot_count = 0;
+                while ( *parser->str == '.' ) {
+                    dot_count++;
+                    parser->str++;
+                }
+
+                // adjust duration if there are dots:
+                float total_ms = (60.0f / (float)parser->bmp) * 1000.0f * (4.0f / (float)d);
+                float prolongation = total_ms / 2.0f;
+                while ( dot_count-- ) {
+                    total_ms += prolongation;
+                    prolongation /= 2;
+                }
+
+                // calculate articulation silence:
+                out->frequency = NoteNumberToFrequency(note);
+                out->note_ms = total_ms * ((float)parser->mode / 8.0f);
+                out->silence_ms = total_ms * ((8.0f - (float)parser->mode) / 8.0f);
+                out->index = parser->notes++;
+                return parse_note;
+            } // A-G, N, and P
+
+            case 'T':
+                parser->bmp = (int)strtol(parser->str, (char **)&parser->str, 10);
+                if ( parser->bmp == 0 )
+                    return ParseError(parser, "bad tempo");
+                break;
+
+            case 'O':
+                if ( *parser->str < '0' || *parser->str > '6' )
+                    return ParseError(parser, "bad octave");
+                parser->oct = (int)strtol(parser->str, (char **)&parser->str, 10);
+                break;
+
+                // TODO: dots not handled
+            case 'L':
+                parser->len = (int)strtol(parser->str, (char **)&parser->str, 10);
+                if ( parser->len < 1 || parser->len > 64 )
+                    return ParseError(parser, "bad length");
+                break;
+
+            case '>':
+                if ( parser->oct < 6 )
+                    parser->oct++;
+                break;
+
+            case '<':
+                if ( parser->oct > 0 )
+                    parser->oct--;
+                break;
+
+            case 'M': {
+                char option = toupper(*parser->str++);
+                switch ( option ) {
+                    case 'L': parser->mode = mode_legato; break;
+                    case 'N': parser->mode = mode_normal; break;
+                    case 'S': parser->mode = mode_staccato; break;
+                    default:
+                        return ParseError(parser, "bad music option");
+                }
+                break;
+            }
+            case '|':
+                return parse_loop_point;
+                
+            case '!': {
+                const char * start = parser->str;
+                long tag = strtol(start, (char **)&parser->str, 10);
+                if ( parser->str == start || tag < 0 || tag > INT_MAX )
+                    return ParseError(parser, "bad marker");
+                out->index = parser->notes;
+                out->tag = (int)tag;
+                return parse_marker;
+            }
+            default:
+                break;
+        }
+    }
+    
+    return parse_end;
+}
+
+// Compile `string`. On a syntax error, `error` is filled in, and NULL is
+// returned unless `partial`, in which case the program has everything before
+// the error. `error->message` is NULL if there was no error.
+static DOS_CompiledPlay * Compile(const char * string, DOS_PlayError * error, bool partial)
+{
+    PlayParser parser;
+    PlayNote note;
+    ParseResult result;
+    
+    if ( error ) {
+        error->message = NULL;
+        error->position = 0;
+    }
+    
+    // count events first, so the program is allocated once
+    int count = 0;
+    StartParser(&parser, string);
+    while ( (result = ParseNote(&parser, &note)) > parse_end ) {
+        if ( result == parse_note ) {
+            count += note.silence_ms > 0 ? 2 : 1;
+        } else if ( result == parse_marker ) {
+            count++;
+        }
+    }
+    
+    if ( result == parse_error ) {
+        if ( error ) {
+            error->message = parser.error;
+            error->position = parser.error_position;
+        }
+        
+        if ( !partial ) {
+            return NULL;
+        }
+    }
+    
+    DOS_CompiledPlay * program;
+    program = malloc(sizeof(*program) + count * sizeof(program->events[0]));
+    
+    if ( program == NULL ) {
+        if ( error ) {
+            error->message = "out of memory";
+            error->position = 0;
+        }
+        return NULL;
+    }
+    
+    program->count = 0;
+    StartParser(&parser, string);
+    while ( (result = ParseNote(&parser, &note)) > parse_end ) {
+        if ( result == parse_marker ) {
+            PlayEvent * marker = &program->events[program->count++];
+            marker->frequency = 0;
+            marker->milliseconds = 0;
+            marker->note = note.index;
+            marker->tag = note.tag;
+            continue;
+        }
+        
+        if ( result != parse_note ) {
+            continue;
+        }
+        
+        PlayEvent * event = &program->events[program->count++];
+        event->frequency = note.frequency;
+        event->milliseconds = note.note_ms;
+        event->note = note.index;
+        event->tag = -1;
+        
+        if ( note.silence_ms > 0 ) {
+            event = &program->events[program->count++];
+            event->frequency = 0;
+            event->milliseconds = note.silence_ms;
+            event->note = note.index;
+            event->tag = -1;
+        }
+    }
+    
+    return program;
+}
+
+DOS_CompiledPlay * DOS_CompilePlay(const char * string, DOS_PlayError * error)
+{
+    return Compile(string, error, false);
+}
+
+void DOS_FreeCompiledPlay(DOS_CompiledPlay * program)
+{
+    free(program);
+}
+
+// Where to play: the PC speaker or a voice.
+#define SPEAKER -1
+
+void DOS_AddPlaySound(int voice, unsigned frequency, unsigned milliseconds, int note);
+void DOS_AddSoundMarker(int voice, int tag, int note);
+
+static void StopSound(int voice)
+{
+    if ( voice == SPEAKER ) {
+        DOS_StopSound();
+    } else {
+        DOS_VoiceStopSound(voice);
+    }
+}
+
+static void PlayProgram(int voice, const DOS_CompiledPlay * program)
+{
+    StopSound(voice);
+    
+    for ( int i = 0; i < program->count; i++ ) {
+        const PlayEvent * event = &program->events[i];
+        
+        if ( event->tag != -1 ) {
+            DOS_AddSoundMarker(voice, event->tag, event->note);
+        } else {
+            DOS_AddPlaySound(voice, event->frequency, event->milliseconds, event->note);
+        }
+    }
+}
+
+static void PlayString(int voice, const char * string, va_list args)
+{
+    int     len;
+    char *  buffer;
+    
+    va_list copy;
+    va_copy(copy, args);
+    
+    len = vsnprintf(NULL, 0, string, args);
+    buffer = calloc(len + 1, sizeof(char));
+    
+    if ( buffer == NULL ) {
+        va_end(copy);
+        fprintf(stderr, "DOS_Play: out of memory\n");
+        return;
+    }
+    
+    vsnprintf(buffer, len + 1, string, copy);
+    
+    va_end(copy);
+    
+    // As before strings were compiled, whatever comes before a syntax error
+    // is still played.
+    DOS_PlayError error;
+    DOS_CompiledPlay * program = Compile(buffer, &error, true);
+    
+    if ( error.message ) {
+        printf("Play syntax error: %s (position %d).\n", error.message, error.position);
+    }
+    
+    if ( program ) {
+        PlayProgram(voice, program);
+        DOS_FreeCompiledPlay(program);
+    }
+    
+    free(buffer);
+}
+
+void DOS_PlayProgram(const DOS_CompiledPlay * program)
+{
+    PlayProgram(SPEAKER, program);
+}
+
+void DOS_VoicePlayProgram(int voice, const DOS_CompiledPlay * program)
+{
+    PlayProgram(voice, program);
+}
+
+void DOS_Play(const char * string, ...)
+{
+    va_list args;
+    va_start(args, string);
+    PlayString(SPEAKER, string, args);
+    va_end(args);
+}
+
+void DOS_VoicePlay(int voice, const char * string, ...)
+{
+    va_list args;
+    va_start(args, string);
+    PlayString(voice, string, args);
+    va_end(args);
+}
+
+// Music
+//
+// Long PLAY strings are parsed and queued a note at a time, only far enough
+// ahead of playback to cover the time until the next pump. A timer pumps the
+// player on SDL's timer thread.
+
+#define MUSIC_LOOKAHEAD_MS  500
+#define MUSIC_PUMP_MS       50
+#define MUSIC_MAX_NOTES     256 // per pump, in case notes round to 0 ms
+
+int DOS_SoundTimeRemaining(void);
+
+static struct
+{
+    char *          string;
+    PlayParser      parser;
+    PlayParser      loop_point; // where to resume when the end is reached
+    bool            loop;
+    bool            noted; // a note was parsed since the last loop restart
+    bool            playing;
+    SDL_TimerID     timer;
+    
+    // A mutex rather than a spin lock, since it's held while notes are
+    // synthesized on the timer thread.
+    SDL_mutex *     lock;
+} music;
+
+static void LockMusic(void)
+{
+    static SDL_SpinLock create_lock;
+    
+    SDL_AtomicLock(&create_lock);
+    if ( music.lock == NULL ) {
+        music.lock = SDL_CreateMutex();
+    }
+    SDL_AtomicUnlock(&create_lock);
+    
+    SDL_LockMutex(music.lock);
+}
+
+static void UnlockMusic(void)
+{
+    SDL_UnlockMutex(music.lock);
+}
+
+static void FreeMusic(void)
+{
+    free(music.string);
+    music.string = NULL;
+    music.playing = false;
+}
+
+// Queue notes until the lookahead is covered. Returns false when the music
+// has ended. Call with the lock held.
+static bool PumpMusic(void)
+{
+    int queued_ms = DOS_SoundTimeRemaining();
+    int notes = 0;
+    
+    while ( music.playing
+           && queued_ms < MUSIC_LOOKAHEAD_MS
+           && notes < MUSIC_MAX_NOTES )
+    {
+        PlayNote note;
+        
+        switch ( ParseNote(&music.parser, &note) ) {
+            case parse_note:
+                DOS_AddPlaySound(SPEAKER, note.frequency, note.note_ms, note.index);
+                if ( note.silence_ms > 0 ) {
+                    DOS_AddPlaySound(SPEAKER, 0, note.silence_ms, note.index);
+                }
+                queued_ms += note.note_ms + note.silence_ms;
+                music.noted = true;
+                notes++;
+                break;
+                
+            case parse_loop_point:
+                music.loop_point = music.parser;
+                break;
+                
+            case parse_marker:
+                DOS_AddSoundMarker(SPEAKER, note.tag, note.index);
+                break;
+                
+            case parse_end:
+                // (don't loop forever if the loop has no notes)
+                if ( music.loop && music.noted ) {
+                    music.parser = music.loop_point;
+                    music.noted = false;
+                } else {
+                    FreeMusic();
+                }
+                break;
+                
+            case parse_error:
+                printf("Play syntax error: %s (position %d).\n",
+                       music.parser.error,
+                       music.parser.error_position);
+                FreeMusic();
+                break;
+        }
+    }
+    
+    return music.playing;
+}
+
+static Uint32 MusicTimer(Uint32 interval, void * param)
+{
+    (void)param;
+    
+    LockMusic();
+    bool playing = PumpMusic();
+    if ( !playing ) {
+        music.timer = 0;
+    }
+    UnlockMusic();
+    
+    return playing ? interval : 0; // returning 0 cancels the timer
+}
+
+void DOS_StopMusic(void)
+{
+    LockMusic();
+    
+    if ( music.timer ) {
+        SDL_RemoveTimer(music.timer);
+        music.timer = 0;
+    }
+    
+    if ( music.playing ) {
+        FreeMusic();
+        DOS_StopSound();
+    }
+    
+    UnlockMusic();
+}
+
+// Takes ownership of `string`.
+static void StartMusic(char * string, bool loop)
+{
+    DOS_StopMusic();
+    
+    if ( SDL_WasInit(SDL_INIT_TIMER) == 0 ) {
+        if ( SDL_InitSubSystem(SDL_INIT_TIMER) < 0 ) {
+            fprintf(stderr, "error: failed to init SDL timer subsystem: %s\n", SDL_GetError());
+            free(string);
+            return;
+        }
+    }
+    
+    LockMusic();
+    
+    music.string = string;
+    StartParser(&music.parser, string);
+    music.loop_point = music.parser;
+    music.loop = loop;
+    music.noted = false;
+    music.playing = true;
+    
+    // queue the first notes now, so playback starts right away
+    if ( PumpMusic() ) {
+        music.timer = SDL_AddTimer(MUSIC_PUMP_MS, MusicTimer, NULL);
+        if ( music.timer == 0 ) {
+            fprintf(stderr, "error: failed to add music timer: %s\n", SDL_GetError());
+            FreeMusic();
+        }
+    }
+    
+    UnlockMusic();
+}
+
+void DOS_PlayMusic(const char * string, bool loop)
+{
+    size_t size = strlen(string) + 1;
+    char * copy = malloc(size);
+    
+    if ( copy == NULL ) {
+        fprintf(stderr, "DOS_PlayMusic: out of memory\n");
+        return;
+    }
+    
+    memcpy(copy, string, size);
+    StartMusic(copy, loop);
+}
+
+bool DOS_PlayMusicFile(const char * path, bool loop)
+{
+    FILE * file = fopen(path, "rb");
+    if ( file == NULL ) {
+        fprintf(stderr, "DOS_PlayMusicFile: could not open '%s'\n", path);
+        return false;
+    }
+    
+    char * string = NULL;
+    long size = -1;
+    
+    if ( fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0 ) {
+        rewind(file);
+        string = malloc(size + 1);
+    }
+    
+    if ( string == NULL || fread(string, 1, size, file) != (size_t)size ) {
+        fprintf(stderr, "DOS_PlayMusicFile: could not read '%s'\n", path);
+        free(string);
+        fclose(file);
+        return false;
+    }
+    
+    string[size] = '\0';
+    fclose(file);
+    StartMusic(string, loop);
+    
+    return true;
+}
+
+bool DOS_MusicIsPlaying(void)
+{
+    LockMusic();
+    bool playing = music.playing;
+    UnlockMusic();
+    
+    return playing;
+}
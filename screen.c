@@ -1,10 +1,14 @@
 #include "textmode.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define DOS_NUM_PAGES   16
 
-typedef struct
+struct DOS_Screen
 {
-    SDL_Window *    window;
+    SDL_Window *    window; // NULL if headless
     int             window_scale;
     bool            fullscreen;
     
@@ -22,35 +26,143 @@ typedef struct
     DOS_Mode        mode;
     int             render_x; // render position of the console
     int             render_y;
-} DOS_Screen;
+    int             render_scale;
+    
+    // With a software renderer, the console is scaled up here rather than by
+    // SDL_RenderSetScale, and only the parts that changed are rescaled.
+    bool            software;
+    SDL_Surface *   scaled;
+    SDL_Texture *   scaled_texture;
+    DOS_Console *   scaled_page; // page last drawn to `scaled`
+    SDL_Rect *      dirty_rects; // one per console row
+    
+    SDL_threadID    owner; // the thread it's active on, or 0
+    
+    DOS_Screen *    next; // in list of all screens
+};
+
+static _Thread_local DOS_Screen * screen; // the active screen
+extern _Thread_local DOS_Console * _current_page;
+
+static DOS_Screen * screen_list;
+static SDL_SpinLock screen_list_lock; // also guards `owner`
+static DOS_Screen * default_screen; // created by DOS_InitScreen
+
+static Uint32 wakeup_time;      // requested by DOS_RequestWakeup
+static bool wakeup_requested;
+static SDL_SpinLock wakeup_lock; // (DOS_RequestWakeup may be called from any thread)
 
-static DOS_Screen screen;
-extern DOS_Console * _current_page;
+int DOS_ConsoleTimeToChange(DOS_Console * console);
+int DOS_SoundTimeRemaining(void);
+SDL_Surface * DOS_UpdateConsoleSurface(DOS_Console * console, SDL_Renderer * renderer, Uint32 * format, const Uint32 ** colors);
+void DOS_RenderConsoleCursor(SDL_Renderer * renderer, DOS_Console * console, int x, int y, int scale);
+void DOS_InvalidateConsole(DOS_Console * console);
+int DOS_TakeDirtyRects(DOS_Console * console, const void * reader, SDL_Rect * rects);
+void DOS_ConsoleSize(DOS_Console * console, int * w, int * h);
 
 
-static void FreeScreen()
+static void AddToScreenList(DOS_Screen * s)
 {
-    SDL_DestroyRenderer(screen.renderer);
-    SDL_DestroyWindow(screen.window);
+    SDL_AtomicLock(&screen_list_lock);
+    s->next = screen_list;
+    screen_list = s;
+    SDL_AtomicUnlock(&screen_list_lock);
+}
+
+// Remove the screen from the list, unless it's active on another thread, which
+// may be using it. Returns false if so.
+static bool RemoveFromScreenList(DOS_Screen * s)
+{
+    SDL_AtomicLock(&screen_list_lock);
+    
+    if ( s->owner != 0 && s->owner != SDL_ThreadID() ) {
+        SDL_AtomicUnlock(&screen_list_lock);
+        return false;
+    }
+    
+    for ( DOS_Screen ** link = &screen_list; *link; link = &(*link)->next ) {
+        if ( *link == s ) {
+            *link = s->next;
+            break;
+        }
+    }
+    SDL_AtomicUnlock(&screen_list_lock);
+    
+    return true;
+}
+
+static void UpdateRenderScaleAndConsolePosition(DOS_Screen * s);
+
+static void FreeScaledConsole(DOS_Screen * s)
+{
+    if ( s->scaled_texture ) {
+        SDL_DestroyTexture(s->scaled_texture);
+        s->scaled_texture = NULL;
+    }
+    
+    if ( s->scaled ) {
+        SDL_FreeSurface(s->scaled);
+        s->scaled = NULL;
+    }
+    
+    s->scaled_page = NULL;
+}
+
+void DOS_FreeScreen(DOS_Screen * s)
+{
+    if ( s == NULL ) {
+        return;
+    }
+    
+    if ( !RemoveFromScreenList(s) ) {
+        fprintf(stderr, "DOS_FreeScreen: screen is active on another thread, "
+                "not freed\n");
+        return;
+    }
+    
+    FreeScaledConsole(s);
+    free(s->dirty_rects);
     
     for ( int i = 0; i < DOS_NUM_PAGES; i++ ) {
-        DOS_FreeConsole(screen.pages[i]);
+        if ( _current_page == s->pages[i] ) {
+            _current_page = NULL;
+        }
+        DOS_FreeConsole(s->pages[i]);
+    }
+    
+    if ( s->renderer ) {
+        DOS_FreeFontTextures(s->renderer);
+        SDL_DestroyRenderer(s->renderer);
+    }
+    
+    if ( s->window ) {
+        SDL_DestroyWindow(s->window);
+    }
+    
+    if ( screen == s ) {
+        screen = NULL;
+    }
+    
+    if ( default_screen == s ) {
+        default_screen = NULL;
     }
+    
+    free(s);
 }
 
-static void NewScreenError(const char * message)
+static DOS_Screen * NewScreenError(DOS_Screen * s, const char * message)
 {
-    fprintf(stderr, "DOS_InitScreen error: %s\n", message);
-    FreeScreen();
+    fprintf(stderr, "DOS_CreateScreen error: %s\n", message);
+    DOS_FreeScreen(s);
     
-    exit(EXIT_FAILURE);
+    return NULL;
 }
 
 static SDL_Rect ConsoleSizeInPixels()
 {
     SDL_Rect rect;
-    rect.w = screen.width * DOS_CHAR_WIDTH;
-    rect.h = screen.height * screen.mode;
+    rect.w = screen->width * DOS_CharWidth(screen->mode);
+    rect.h = screen->height * DOS_CharHeight(screen->mode);
     
     return rect;
 }
@@ -61,12 +173,105 @@ static SDL_Rect UnscaledWindowRect()
     
     rect.x = SDL_WINDOWPOS_CENTERED;
     rect.y = SDL_WINDOWPOS_CENTERED;
-    rect.w += screen.border_size * 2;
-    rect.h += screen.border_size * 2;
+    rect.w += screen->border_size * 2;
+    rect.h += screen->border_size * 2;
     
     return rect;
 }
 
+DOS_Screen *
+DOS_CreateScreen
+(   const char * window_name,
+    int console_w,
+    int console_h,
+    DOS_Mode mode,
+    int border_size )
+{
+    DOS_Screen * s = calloc(1, sizeof(*s));
+    
+    if ( s == NULL ) {
+        return NewScreenError(NULL, "could not allocate memory for screen");
+    }
+    
+    s->width        = console_w;
+    s->height       = console_h;
+    s->mode         = mode;
+    s->border_size  = border_size;
+    s->border_color = DOS_BLACK;
+    s->active_page  = 0;
+    s->blink        = false;
+    s->fullscreen   = false;
+    s->window_scale = 1;
+    s->render_scale = 1;
+    
+    s->dirty_rects = malloc(console_h * sizeof(*s->dirty_rects));
+    
+    if ( s->dirty_rects == NULL ) {
+        return NewScreenError(s, "could not allocate dirty rects");
+    }
+    
+    // creating the pages would otherwise change the current page
+    DOS_Console * current_page = _current_page;
+    
+    for ( int i = 0; i < DOS_NUM_PAGES; i++ ) {
+        s->pages[i] = DOS_CreateConsole(console_w, console_h, mode);
+        
+        if ( s->pages[i] == NULL ) {
+            _current_page = current_page;
+            return NewScreenError(s, "could not create console");
+        }
+    }
+    
+    _current_page = current_page;
+    
+    if ( window_name != NULL ) {
+        if ( SDL_WasInit(SDL_INIT_VIDEO) == 0 ) {
+            if ( SDL_InitSubSystem(SDL_INIT_VIDEO) < 0 ) {
+                return NewScreenError(s, "could not init SDL video");
+            }
+        }
+        
+        DOS_Screen * active = screen;
+        screen = s; // for the helpers below
+        
+        SDL_Rect w = UnscaledWindowRect();
+        uint32_t flags = 0;
+        //flags |= SDL_WINDOW_ALLOW_HIGHDPI;
+        s->window = SDL_CreateWindow(window_name, w.x, w.y, w.w, w.h, flags);
+        
+        if ( s->window == NULL ) {
+            screen = active;
+            return NewScreenError(s, "could not create SDL window");
+        }
+        
+        s->renderer = SDL_CreateRenderer(s->window, -1, 0);
+        
+        if ( s->renderer == NULL ) {
+            screen = active;
+            return NewScreenError(s, "could not create SDL renderer");
+        }
+        
+        SDL_SetRenderDrawBlendMode(s->renderer, SDL_BLENDMODE_BLEND);
+        
+        SDL_RendererInfo info;
+        if ( SDL_GetRendererInfo(s->renderer, &info) == 0 ) {
+            s->software = info.flags & SDL_RENDERER_SOFTWARE;
+        }
+        
+        DOS_SetFullscreen(false);
+        screen = active;
+    }
+    
+    AddToScreenList(s);
+    
+    return s;
+}
+
+static void FreeDefaultScreen(void)
+{
+    DOS_FreeScreen(default_screen);
+}
+
 void
 DOS_InitScreen
 (   const char * window_name,
@@ -81,45 +286,76 @@ DOS_InitScreen
         atexit(SDL_Quit);
     }
     
-    screen.width        = console_w;
-    screen.height       = console_h;
-    screen.mode         = mode;
-    screen.border_size  = border_size;
-    screen.border_color = DOS_BLACK;
-    screen.active_page  = 0;
-    screen.blink        = false;
-    screen.fullscreen   = false;
-    screen.window_scale = 1;
+    default_screen = DOS_CreateScreen(window_name, console_w, console_h, mode, border_size);
     
-    SDL_Rect w = UnscaledWindowRect();
-    uint32_t flags = 0;
-    //flags |= SDL_WINDOW_ALLOW_HIGHDPI;
-    screen.window = SDL_CreateWindow(window_name, w.x, w.y, w.w, w.h, flags);
+    if ( default_screen == NULL ) {
+        fprintf(stderr, "DOS_InitScreen error: could not create screen\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    DOS_SetActiveScreen(default_screen);
     
-    if ( screen.window == NULL ) {
-        return NewScreenError("could not create SDL window");
+    atexit(FreeDefaultScreen);
+}
+
+void DOS_SetActiveScreen(DOS_Screen * new_screen)
+{
+    SDL_AtomicLock(&screen_list_lock);
+    
+    if ( screen && screen->owner == SDL_ThreadID() ) {
+        screen->owner = 0;
     }
     
-    screen.renderer = SDL_CreateRenderer(screen.window, -1, 0);
+    screen = new_screen;
     
-    if ( screen.renderer == NULL ) {
-        return NewScreenError("could not create SDL renderer");
+    if ( screen ) {
+        screen->owner = SDL_ThreadID();
+        _current_page = screen->pages[screen->active_page];
     }
+    
+    SDL_AtomicUnlock(&screen_list_lock);
+}
 
-    SDL_SetRenderDrawBlendMode(screen.renderer, SDL_BLENDMODE_BLEND);
-        
-    for ( int i = 0; i < DOS_NUM_PAGES; i++ ) {
-        screen.pages[i] = DOS_CreateConsole(console_w, console_h, mode);
-        
-        if ( screen.pages[i] == NULL ) {
-            return NewScreenError("could not create console");
+DOS_Screen * DOS_GetActiveScreen(void)
+{
+    return screen;
+}
+
+DOS_Screen * DOS_GetScreenFromWindowID(Uint32 window_id)
+{
+    DOS_Screen * result = NULL;
+    
+    SDL_AtomicLock(&screen_list_lock);
+    for ( DOS_Screen * s = screen_list; s; s = s->next ) {
+        if ( s->window && SDL_GetWindowID(s->window) == window_id ) {
+            result = s;
+            break;
         }
     }
-          
-    _current_page = screen.pages[0];
-    DOS_SetFullscreen(false);
+    SDL_AtomicUnlock(&screen_list_lock);
+    
+    return result;
+}
+
+DOS_Console * DOS_GetPage(int page)
+{
+    if ( page < 0 || page >= DOS_NUM_PAGES ) {
+        return NULL;
+    }
     
-    atexit(FreeScreen);
+    return screen->pages[page];
+}
+
+void DOS_SetScreenBackend(const DOS_Backend * backend)
+{
+    DOS_Console * current_page = _current_page;
+    
+    for ( int i = 0; i < DOS_NUM_PAGES; i++ ) {
+        _current_page = screen->pages[i];
+        DOS_SetBackend(backend);
+    }
+    
+    _current_page = current_page;
 }
 
 void DOS_SwitchPage(int new_page)
@@ -128,60 +364,255 @@ void DOS_SwitchPage(int new_page)
         return;
     }
     
-    screen.active_page = new_page;
-    _current_page = screen.pages[new_page];
+    screen->active_page = new_page;
+    _current_page = screen->pages[new_page];
 }
 
 int DOS_CurrentPage()
 {
-    return screen.active_page;
+    return screen->active_page;
 }
 
-void DOS_DrawScreen()
+// Replicate each pixel in `src` into a `scale` x `scale` block in `dst`. If
+// `colors` is not NULL, `src` is 8-bit and its pixels are looked up in it.
+static void
+ScalePixels
+(   const Uint8 * src,
+    int src_pitch,
+    const Uint32 * colors,
+    Uint8 * dst,
+    int dst_pitch,
+    int w,
+    int h,
+    int scale )
 {
-    DOS_SetColor(screen.renderer, screen.border_color);
-    SDL_RenderClear(screen.renderer);
-    DOS_RenderConsole(screen.renderer, _current_page, screen.render_x, screen.render_y);
-    SDL_RenderPresent(screen.renderer);
+    for ( int y = 0; y < h; y++ ) {
+        const Uint32 * in = (const Uint32 *)(src + y * src_pitch);
+        Uint32 * out = (Uint32 *)(dst + y * scale * dst_pitch);
+        int x = 0;
+        
+        if ( colors ) {
+            const Uint8 * index = src + y * src_pitch;
+            for ( ; x < w; x++ ) {
+                Uint32 color = colors[index[x]];
+                for ( int i = 0; i < scale; i++ ) {
+                    out[x * scale + i] = color;
+                }
+            }
+        } else {
+            switch ( scale ) {
+                case 2:
+#ifdef __SSE2__
+                    for ( ; x + 4 <= w; x += 4 ) {
+                        __m128i p = _mm_loadu_si128((const __m128i *)(in + x));
+                        _mm_storeu_si128((__m128i *)(out + x * 2), _mm_unpacklo_epi32(p, p));
+                        _mm_storeu_si128((__m128i *)(out + x * 2 + 4), _mm_unpackhi_epi32(p, p));
+                    }
+#endif
+                    for ( ; x < w; x++ ) {
+                        out[x * 2] = out[x * 2 + 1] = in[x];
+                    }
+                    break;
+                case 4:
+#ifdef __SSE2__
+                    for ( ; x + 4 <= w; x += 4 ) {
+                        __m128i p = _mm_loadu_si128((const __m128i *)(in + x));
+                        __m128i * o = (__m128i *)(out + x * 4);
+                        _mm_storeu_si128(o + 0, _mm_shuffle_epi32(p, 0x00));
+                        _mm_storeu_si128(o + 1, _mm_shuffle_epi32(p, 0x55));
+                        _mm_storeu_si128(o + 2, _mm_shuffle_epi32(p, 0xAA));
+                        _mm_storeu_si128(o + 3, _mm_shuffle_epi32(p, 0xFF));
+                    }
+#endif
+                    for ( ; x < w; x++ ) {
+                        out[x * 4] = out[x * 4 + 1] = out[x * 4 + 2] = out[x * 4 + 3] = in[x];
+                    }
+                    break;
+                default:
+                    for ( ; x < w; x++ ) {
+                        for ( int i = 0; i < scale; i++ ) {
+                            *out++ = in[x];
+                        }
+                    }
+                    out -= w * scale;
+                    break;
+            }
+        }
+        
+        // the rest of the block's rows are copies of the first
+        for ( int i = 1; i < scale; i++ ) {
+            memcpy((Uint8 *)out + i * dst_pitch, out, w * scale * sizeof(Uint32));
+        }
+    }
 }
 
-void DOS_DrawScreenEx(void (* user_function)(void * data), void * user_data)
+// Rescale whatever changed in the page since the last frame and draw it.
+static void DrawScaledConsole(DOS_Screen * s, DOS_Console * page)
 {
-    DOS_SetColor(screen.renderer, screen.border_color);
-    SDL_RenderClear(screen.renderer);
-    DOS_RenderConsole(screen.renderer, _current_page, screen.render_x, screen.render_y);
+    Uint32 format;
+    const Uint32 * colors;
+    SDL_Surface * surface = DOS_UpdateConsoleSurface(page, s->renderer, &format, &colors);
+    int scale = s->render_scale;
+    
+    if ( surface == NULL ) { // the page's backend scales as it draws
+        DOS_RenderConsole(s->renderer, page, s->render_x, s->render_y);
+        return;
+    }
+    
+    if ( s->scaled
+        && (s->scaled->format->format != format
+            || s->scaled->w != surface->w * scale
+            || s->scaled->h != surface->h * scale) ) {
+        FreeScaledConsole(s);
+    }
+    
+    if ( s->scaled == NULL ) {
+        s->scaled = SDL_CreateRGBSurfaceWithFormat(0,
+                                                   surface->w * scale,
+                                                   surface->h * scale,
+                                                   32,
+                                                   format);
+        s->scaled_texture = SDL_CreateTexture(s->renderer,
+                                              format,
+                                              SDL_TEXTUREACCESS_STREAMING,
+                                              surface->w * scale,
+                                              surface->h * scale);
+        
+        if ( s->scaled == NULL || s->scaled_texture == NULL ) {
+            fprintf(stderr, "DOS_DrawScreen: could not create scaled console, "
+                    "using renderer scaling (%s)\n", SDL_GetError());
+            FreeScaledConsole(s);
+            s->software = false;
+            UpdateRenderScaleAndConsolePosition(s);
+            DOS_RenderConsole(s->renderer, page, s->render_x, s->render_y);
+            return;
+        }
+        
+        SDL_SetTextureBlendMode(s->scaled_texture, SDL_BLENDMODE_BLEND);
+    }
+    
+    if ( page != s->scaled_page ) {
+        DOS_InvalidateConsole(page);
+        s->scaled_page = page;
+    }
+    
+    int count = DOS_TakeDirtyRects(page, s, s->dirty_rects);
+    
+    for ( int i = 0; i < count; i++ ) {
+        SDL_Rect * r = &s->dirty_rects[i];
+        SDL_Rect scaled_rect = { r->x * scale, r->y * scale, r->w * scale, r->h * scale };
+        
+        const Uint8 * src = (const Uint8 *)surface->pixels;
+        src += r->y * surface->pitch + r->x * surface->format->BytesPerPixel;
+        Uint8 * dst = (Uint8 *)s->scaled->pixels;
+        dst += scaled_rect.y * s->scaled->pitch + scaled_rect.x * sizeof(Uint32);
+        
+        ScalePixels(src, surface->pitch, colors, dst, s->scaled->pitch, r->w, r->h, scale);
+        SDL_UpdateTexture(s->scaled_texture, &scaled_rect, dst, s->scaled->pitch);
+    }
+    
+    int x = s->render_x * scale;
+    int y = s->render_y * scale;
+    SDL_Rect dst = { x, y, s->scaled->w, s->scaled->h };
+    
+    SDL_RenderSetScale(s->renderer, 1, 1);
+    SDL_RenderCopy(s->renderer, s->scaled_texture, NULL, &dst);
+    DOS_RenderConsoleCursor(s->renderer, page, x, y, scale);
+    SDL_RenderSetScale(s->renderer, scale, scale);
+}
+
+// Pages can be resized with DOS_ResizeConsole, or differ in size: lay the
+// screen out for the one being shown. Returns false if out of memory.
+static bool FitScreenToPage(DOS_Screen * s, DOS_Console * page)
+{
+    int w, h;
+    DOS_ConsoleSize(page, &w, &h);
+    
+    if ( w == s->width && h == s->height ) {
+        return true;
+    }
+    
+    SDL_Rect * dirty_rects = realloc(s->dirty_rects, h * sizeof(*dirty_rects));
+    
+    if ( dirty_rects == NULL ) {
+        fprintf(stderr, "DOS_DrawScreen: could not allocate dirty rects\n");
+        return false;
+    }
+    
+    s->dirty_rects = dirty_rects;
+    s->width = w;
+    s->height = h;
+    FreeScaledConsole(s);
+    
+    if ( s->window ) {
+        UpdateRenderScaleAndConsolePosition(s);
+    }
+    
+    return true;
+}
+
+static void DrawScreen(DOS_Screen * s, void (* user_function)(void * data), void * user_data)
+{
+    DOS_Console * page = s->pages[s->active_page];
+    bool fits = FitScreenToPage(s, page);
+    
+    if ( s->renderer == NULL ) { // headless: only for backends that need no renderer
+        DOS_RenderConsole(NULL, page, 0, 0);
+        return;
+    }
+    
+    DOS_SetColor(s->renderer, s->border_color);
+    SDL_RenderClear(s->renderer);
+    
+    if ( s->software && s->render_scale > 1 && fits ) {
+        DrawScaledConsole(s, page);
+    } else {
+        DOS_RenderConsole(s->renderer, page, s->render_x, s->render_y);
+    }
     
     if ( user_function ) {
         user_function(user_data);
     }
     
-    SDL_RenderPresent(screen.renderer);
+    SDL_RenderPresent(s->renderer);
+}
+
+void DOS_DrawScreen()
+{
+    DrawScreen(screen, NULL, NULL);
+}
+
+void DOS_DrawScreenEx(void (* user_function)(void * data), void * user_data)
+{
+    DrawScreen(screen, user_function, user_data);
 }
 
 SDL_Window * DOS_GetWindow()
 {
-    return screen.window;
+    return screen->window;
 }
 
 SDL_Renderer * DOS_GetRenderer()
 {
-    return screen.renderer;
+    return screen->renderer;
 }
 
 void DOS_SetBorderColor(int color)
 {
-    screen.border_color = color;
+    screen->border_color = color;
 }
 
-static void UpdateRenderScaleAndConsolePosition()
+static void UpdateRenderScaleAndConsolePosition(DOS_Screen * s)
 {
     SDL_Rect window;
-    SDL_GetWindowSize(screen.window, &window.w, &window.h);
+    SDL_GetWindowSize(s->window, &window.w, &window.h);
     
-    SDL_Rect console = ConsoleSizeInPixels();
+    SDL_Rect console;
+    console.w = s->width * DOS_CharWidth(s->mode);
+    console.h = s->height * DOS_CharHeight(s->mode);
     SDL_Rect minimum_area = console;
  
-    int margins = screen.border_size * 2;
+    int margins = s->border_size * 2;
     minimum_area.w += margins;
     minimum_area.h += margins;
         
@@ -193,33 +624,42 @@ static void UpdateRenderScaleAndConsolePosition()
     };
         
     // let the draw scale be updateth
-    SDL_RenderSetScale(screen.renderer, scale, scale);
+    SDL_RenderSetScale(s->renderer, scale, scale);
+    
+    if ( scale != s->render_scale ) {
+        FreeScaledConsole(s); // rebuilt at the new scale on next draw
+        s->render_scale = scale;
+    }
     
     // let the render position be updateth so in the middle it be put
-    screen.render_x = (window.w/scale - console.w) / 2;
-    screen.render_y = (window.h/scale - console.h) / 2;
+    s->render_x = (window.w/scale - console.w) / 2;
+    s->render_y = (window.h/scale - console.h) / 2;
 }
 
 void DOS_SetFullscreen(bool fullscreen)
 {
+    if ( screen->window == NULL ) {
+        return;
+    }
+    
     if ( fullscreen ) {
-        SDL_SetWindowFullscreen(screen.window, SDL_WINDOW_FULLSCREEN_DESKTOP);
+        SDL_SetWindowFullscreen(screen->window, SDL_WINDOW_FULLSCREEN_DESKTOP);
     } else {
-        SDL_SetWindowFullscreen(screen.window, 0);
+        SDL_SetWindowFullscreen(screen->window, 0);
     }
     
-    UpdateRenderScaleAndConsolePosition();
+    UpdateRenderScaleAndConsolePosition(screen);
 }
 
 void DOS_ToggleFullscreen()
 {
-    screen.fullscreen = !screen.fullscreen;
-    DOS_SetFullscreen(screen.fullscreen);
+    screen->fullscreen = !screen->fullscreen;
+    DOS_SetFullscreen(screen->fullscreen);
 }
 
 void DOS_SetScreenScale(int scale)
 {
-    if ( screen.fullscreen ) {
+    if ( screen->window == NULL || screen->fullscreen ) {
         return;
     }
     
@@ -227,25 +667,25 @@ void DOS_SetScreenScale(int scale)
         return;
     }
     
-    screen.window_scale = scale;
+    screen->window_scale = scale;
     
     SDL_Rect base_size = UnscaledWindowRect();
     int center = SDL_WINDOWPOS_CENTERED;
     
-    SDL_SetWindowSize(screen.window, base_size.w * scale, base_size.h * scale);
-    SDL_SetWindowPosition(screen.window, center, center);
+    SDL_SetWindowSize(screen->window, base_size.w * scale, base_size.h * scale);
+    SDL_SetWindowPosition(screen->window, center, center);
     
-    UpdateRenderScaleAndConsolePosition();
+    UpdateRenderScaleAndConsolePosition(screen);
 }
 
 void DOS_IncreaseScreenScale()
 {
-    DOS_SetScreenScale(screen.window_scale + 1);
+    DOS_SetScreenScale(screen->window_scale + 1);
 }
 
 void DOS_DecreaseScreenScale()
 {
-    DOS_SetScreenScale(screen.window_scale - 1);
+    DOS_SetScreenScale(screen->window_scale - 1);
 }
 
 float DOS_LimitFrameRate(int fps)
@@ -273,3 +713,121 @@ float DOS_LimitFrameRate(int fps)
     return dt;
 }
 
+
+void DOS_RequestWakeup(unsigned milliseconds)
+{
+    Uint32 time = SDL_GetTicks() + milliseconds;
+    
+    SDL_AtomicLock(&wakeup_lock);
+    if ( !wakeup_requested || (Sint32)(time - wakeup_time) < 0 ) {
+        wakeup_time = time;
+        wakeup_requested = true;
+    }
+    SDL_AtomicUnlock(&wakeup_lock);
+}
+
+// Returns the number of milliseconds the run loop can sleep before something
+// needs attention, or -1 if it can sleep until the next event.
+static int TimeToNextDeadline(bool sound_was_playing)
+{
+    int timeout = -1;
+    
+    SDL_AtomicLock(&screen_list_lock);
+    for ( DOS_Screen * s = screen_list; s; s = s->next ) {
+        if ( s->window ) {
+            int time = DOS_ConsoleTimeToChange(s->pages[s->active_page]);
+            if ( time != -1 && (timeout == -1 || time < timeout) ) {
+                timeout = time;
+            }
+        }
+    }
+    SDL_AtomicUnlock(&screen_list_lock);
+    
+    // wake when sound finishes so the handler can see it end
+    if ( sound_was_playing ) {
+        int sound_time = DOS_SoundTimeRemaining();
+        if ( timeout == -1 || sound_time < timeout ) {
+            timeout = sound_time;
+        }
+    }
+    
+    SDL_AtomicLock(&wakeup_lock);
+    bool requested = wakeup_requested;
+    Uint32 time = wakeup_time;
+    SDL_AtomicUnlock(&wakeup_lock);
+    
+    if ( requested ) {
+        Sint32 wakeup = (Sint32)(time - SDL_GetTicks());
+        if ( wakeup < 0 ) {
+            wakeup = 0;
+        }
+        if ( timeout == -1 || wakeup < timeout ) {
+            timeout = wakeup;
+        }
+    }
+    
+    return timeout;
+}
+
+// Draw every screen that has a window. (Windows can only be used on the main
+// thread, so these all belong to the thread running the loop, and none can be
+// freed while it draws: the lock is only held to walk the list, so other
+// threads aren't kept waiting for a frame.)
+static void DrawAllScreens(void)
+{
+    SDL_AtomicLock(&screen_list_lock);
+    for ( DOS_Screen * s = screen_list; s; s = s->next ) {
+        if ( s->window ) {
+            SDL_AtomicUnlock(&screen_list_lock);
+            DrawScreen(s, NULL, NULL);
+            SDL_AtomicLock(&screen_list_lock);
+        }
+    }
+    SDL_AtomicUnlock(&screen_list_lock);
+}
+
+void
+DOS_RunLoop
+(   bool (* event_handler)(SDL_Event * event, void * user_data),
+    void * user_data )
+{
+    bool run = true;
+    
+    while ( run ) {
+        DrawAllScreens();
+        
+        bool sound_was_playing = DOS_SoundTimeRemaining() > 0;
+        int timeout = TimeToNextDeadline(sound_was_playing);
+        
+        SDL_Event event;
+        int got_event;
+        if ( timeout == -1 ) {
+            got_event = SDL_WaitEvent(&event);
+        } else {
+            got_event = SDL_WaitEventTimeout(&event, timeout);
+        }
+        
+        if ( !got_event ) { // a deadline passed
+            SDL_AtomicLock(&wakeup_lock);
+            if ( wakeup_requested
+                && (Sint32)(wakeup_time - SDL_GetTicks()) <= 0 ) {
+                wakeup_requested = false;
+            }
+            SDL_AtomicUnlock(&wakeup_lock);
+            
+            if ( event_handler ) {
+                run = event_handler(NULL, user_data);
+            }
+            continue;
+        }
+        
+        // handle everything that's pending before drawing again
+        do {
+            if ( event_handler ) {
+                run = event_handler(&event, user_data);
+            } else if ( event.type == SDL_QUIT ) {
+                run = false;
+            }
+        } while ( run && SDL_PollEvent(&event) );
+    }
+}
@@ -1,44 +1,107 @@
 #include "textmode.h"
 
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 static SDL_AudioSpec spec;
 static SDL_AudioDeviceID device;
 static uint8_t volume = 5;
 
 static bool is_muted = false;
 
+static DOS_SoundEngine engine = DOS_SOUND_QUEUED;
 
-static double NoteNumberToFrequency(int note_num)
-{
-    static const int frequencies[] = { // in octave 6
-        4186, // C
-        4435, // C#
-        4699, // D
-        4978, // D#
-        5274, // E
-        5588, // F
-        5920, // F#
-        6272, // G
-        6645, // G#
-        7040, // A
-        7459, // A#
-        7902, // B
-    };
+// A single-producer, single-consumer lock-free ring buffer, used to pass
+// sound events to the audio callback without blocking it. Several threads can
+// push by going through RingPushShared, which serializes producers with a
+// spin lock that the consumer never takes.
+typedef struct
+{
+    void *          items;
+    int             item_size;
+    int             capacity;   // must be a power of two
+    SDL_atomic_t    head;       // next item to pop, written by the consumer
+    SDL_atomic_t    tail;       // next free slot, written by the producer
+    SDL_atomic_t    overflows;  // pushes dropped because the ring was full
+    SDL_SpinLock    producer_lock;
+} Ring;
 
-    int octave = (note_num - 1) / 12;
-    int note = (note_num - 1) % 12;
-    int freq = frequencies[note];
+// Head and tail count up forever (wrapping) and are masked to find the slot.
+static void * RingSlot(Ring * ring, unsigned index)
+{
+    return (Uint8 *)ring->items + (index & (ring->capacity - 1)) * ring->item_size;
+}
 
-    int octaves_down = 6 - octave;
-    while ( octaves_down-- )
-        freq /= 2;
+// Returns false and counts an overflow if the ring is full.
+static bool RingPush(Ring * ring, const void * item)
+{
+    unsigned tail = SDL_AtomicGet(&ring->tail);
+    
+    if ( tail - (unsigned)SDL_AtomicGet(&ring->head) >= (unsigned)ring->capacity ) {
+        SDL_AtomicAdd(&ring->overflows, 1);
+        return false;
+    }
+    
+    memcpy(RingSlot(ring, tail), item, ring->item_size);
+    SDL_MemoryBarrierRelease(); // item is written before it's published
+    SDL_AtomicSet(&ring->tail, tail + 1);
+    
+    return true;
+}
+
+static bool RingPushShared(Ring * ring, const void * item)
+{
+    SDL_AtomicLock(&ring->producer_lock);
+    bool result = RingPush(ring, item);
+    SDL_AtomicUnlock(&ring->producer_lock);
+    
+    return result;
+}
 
-    return (double)freq * 2.0; // basic notes sound 1 octave higher
+// Copies the next item to `item`, and its sequence number (its position in the
+// stream of items pushed) to `sequence`. Returns false if the ring is empty.
+static bool RingPop(Ring * ring, void * item, unsigned * sequence)
+{
+    unsigned head = SDL_AtomicGet(&ring->head);
+    
+    if ( head == (unsigned)SDL_AtomicGet(&ring->tail) ) {
+        return false;
+    }
+    
+    SDL_MemoryBarrierAcquire(); // see the item as written
+    memcpy(item, RingSlot(ring, head), ring->item_size);
+    SDL_AtomicSet(&ring->head, head + 1);
+    *sequence = head;
+    
+    return true;
 }
 
+// DOS_SOUND_SYNTHESIZED: a sound waiting to be played by the audio callback.
+
+#define SYNTH_QUEUE_SIZE 1024
+
+typedef struct
+{
+    unsigned    frequency;
+    unsigned    milliseconds;
+    int8_t      amplitude;
+    Uint32      time; // when it was added (SDL_GetTicks)
+    int         note; // index in its PLAY string, or -1
+    int         tag;  // if not -1, this is a marker, not a sound
+    bool        is_effect;
+    DOS_SoundEffect effect; // if `is_effect`
+} SoundEvent;
+
+static void FreeMarkerCallbacks(void);
+
 static void DOS_QuitSound(void) {
     DOS_StopSound();
     SDL_PauseAudioDevice(device, SDL_TRUE);
     SDL_CloseAudioDevice(device);
+    FreeMarkerCallbacks();
 }
 
 void DOS_Mute(bool muted)
@@ -46,35 +109,1151 @@ void DOS_Mute(bool muted)
     is_muted = muted;
 }
 
+static Uint32 SamplesRemaining(void);
+
 bool DOS_SoundIsPlaying(void)
 {
-    return SDL_GetQueuedAudioSize(device) > 0;
+    return SamplesRemaining() > 0;
 }
 
-void DOS_AddSound(unsigned frequency, unsigned milliseconds)
+// Milliseconds of queued sound left to play. (Used by DOS_RunLoop.)
+int DOS_SoundTimeRemaining(void)
 {
-    if ( is_muted ) {
-        return;
+    if ( spec.freq == 0 ) {
+        return 0; // sound not initialized
     }
     
-    float period = (float)spec.freq / (float)frequency;
-    int len = (float)spec.freq * ((float)milliseconds / 1000.0f);
+    Uint32 samples = SamplesRemaining();
+    
+    return (int)((samples * 1000ull + spec.freq - 1) / spec.freq);
+}
+
+// Generates the square wave for one sound, a block at a time.
+//
+// Sound was originally generated one sample at a time, as
+// `(int)((float)i / period) % 2 ? volume : -volume`. To produce exactly the
+// same samples without a float division per sample, integer math predicts
+// where each half period ends and the original expression is only evaluated
+// there, to confirm the edge. The samples in between are filled in bulk.
+typedef struct
+{
+    int         length;     // in samples
+    int         position;   // next sample to generate
+    unsigned    frequency;  // 0 for silence
+    int         rate;
+    float       period;     // samples per period
+    int         half_period; // which half period `position` is in
+    int         edge;       // where the next half period starts
+    int8_t      amplitude;
+} SquareWave;
 
-    for ( int i = 0; i < len; i++ ) {
+static int HalfPeriod(const SquareWave * wave, int i)
+{
+    return (int)((float)i / wave->period);
+}
+
+// Find the first sample after the current half period.
+static void FindEdge(SquareWave * wave)
+{
+    int next = wave->half_period + 1;
+    int64_t edge = ((int64_t)next * wave->rate + wave->frequency - 1) / wave->frequency;
+    
+    if ( edge <= wave->position ) {
+        edge = wave->position + 1;
+    }
+    
+    while ( edge > wave->position + 1 && HalfPeriod(wave, (int)edge - 1) >= next ) {
+        edge--;
+    }
+    
+    while ( edge < wave->length && HalfPeriod(wave, (int)edge) < next ) {
+        edge++;
+    }
+    
+    wave->edge = edge < wave->length ? (int)edge : wave->length;
+}
+
+static void
+StartSquareWave
+(   SquareWave * wave,
+    unsigned frequency,
+    unsigned milliseconds,
+    int rate,
+    int8_t amplitude )
+{
+    wave->length = (float)rate * ((float)milliseconds / 1000.0f);
+    wave->position = 0;
+    wave->frequency = frequency;
+    wave->rate = rate;
+    wave->amplitude = amplitude;
+    wave->half_period = 0;
+    
+    if ( frequency == 0 ) {
+        wave->edge = wave->length;
+    } else {
+        wave->period = (float)rate / (float)frequency;
+        FindEdge(wave);
+    }
+}
+
+// Write up to `count` samples to `out`. Returns the number written.
+static int GenerateSquareWave(SquareWave * wave, int8_t * out, int count)
+{
+    int written = 0;
+    
+    while ( written < count && wave->position < wave->length ) {
         int8_t sample;
+        if ( wave->frequency == 0 ) {
+            sample = 0; // silence
+        } else {
+            sample = wave->half_period % 2 ? wave->amplitude : -wave->amplitude;
+        }
+        
+        int run = wave->edge - wave->position;
+        if ( run > count - written ) {
+            run = count - written;
+        }
+        
+        memset(out + written, sample, run);
+        written += run;
+        wave->position += run;
+        
+        if ( wave->position == wave->edge && wave->position < wave->length ) {
+            wave->half_period = HalfPeriod(wave, wave->position);
+            FindEdge(wave);
+        }
+    }
+    
+    return written;
+}
+
+// Noise for the noise voice: a 15-bit linear feedback shift register, clocked
+// `frequency` times per second, like the Tandy / PCjr noise channel.
+typedef struct
+{
+    int         length;     // in samples
+    int         position;   // next sample to generate
+    unsigned    frequency;  // 0 for silence
+    int         rate;
+    unsigned    clock;      // counts up to `rate` between shifts
+    Uint16      lfsr;
+    int8_t      amplitude;
+} Noise;
+
+static void
+StartNoise
+(   Noise * noise,
+    unsigned frequency,
+    unsigned milliseconds,
+    int rate,
+    int8_t amplitude )
+{
+    noise->length = (float)rate * ((float)milliseconds / 1000.0f);
+    noise->position = 0;
+    noise->frequency = frequency;
+    noise->rate = rate;
+    noise->clock = 0;
+    noise->lfsr = 1 << 14;
+    noise->amplitude = amplitude;
+}
+
+static int GenerateNoise(Noise * noise, int8_t * out, int count)
+{
+    int written = 0;
+    
+    while ( written < count && noise->position < noise->length ) {
+        if ( noise->frequency == 0 ) {
+            out[written] = 0; // silence
+        } else {
+            noise->clock += noise->frequency;
+            while ( noise->clock >= (unsigned)noise->rate ) {
+                noise->clock -= noise->rate;
+                Uint16 bit = (noise->lfsr ^ (noise->lfsr >> 1)) & 1;
+                noise->lfsr = (noise->lfsr >> 1) | (bit << 14);
+            }
+            
+            out[written] = noise->lfsr & 1 ? noise->amplitude : -noise->amplitude;
+        }
+        
+        written++;
+        noise->position++;
+    }
+    
+    return written;
+}
+
+// A parametric sound effect, evaluated a sample at a time. The phase carries
+// over from one effect to the next on a channel, so chained effects don't
+// click.
+typedef struct
+{
+    int         length;     // in samples
+    int         position;   // next sample to generate
+    int         rate;
+    double      frequency;  // current, before vibrato
+    double      step;       // added to `frequency` each sample (linear)
+    double      ratio;      // `frequency` is multiplied by this (exponential)
+    double      phase;      // 0-1, position in the current period
+    double      vibrato_phase;
+    double      vibrato_step;
+    double      vibrato_depth;
+    double      duty;       // fraction of each period that is high
+    bool        noise;
+    Uint16      lfsr;
+    int8_t      amplitude;
+} Effect;
+
+static void
+StartEffect
+(   Effect * wave,
+    const DOS_SoundEffect * effect,
+    int rate,
+    int8_t amplitude )
+{
+    wave->length = (float)rate * ((float)effect->milliseconds / 1000.0f);
+    wave->position = 0;
+    wave->rate = rate;
+    wave->amplitude = amplitude;
+    wave->frequency = effect->start_frequency;
+    wave->step = 0.0;
+    wave->ratio = 1.0;
+    
+    double start = effect->start_frequency;
+    double end = effect->end_frequency;
+    
+    if ( wave->length > 0 ) {
+        if ( effect->curve == DOS_SWEEP_EXPONENTIAL && start > 0.0 && end > 0.0 ) {
+            wave->ratio = pow(end / start, 1.0 / wave->length);
+        } else {
+            wave->step = (end - start) / wave->length;
+        }
+    }
+    
+    wave->vibrato_phase = 0.0;
+    wave->vibrato_step = effect->vibrato_rate / rate;
+    wave->vibrato_depth = effect->vibrato_depth;
+    
+    int duty = effect->duty == 0 ? 50 : effect->duty;
+    if ( duty < 1 ) duty = 1;
+    if ( duty > 99 ) duty = 99;
+    wave->duty = duty / 100.0;
+    
+    wave->noise = effect->noise;
+    if ( wave->lfsr == 0 ) {
+        wave->lfsr = 1 << 14;
+    }
+}
+
+static int GenerateEffect(Effect * wave, int8_t * out, int count)
+{
+    int written = 0;
+    
+    while ( written < count && wave->position < wave->length ) {
+        double frequency = wave->frequency;
+        
+        if ( wave->vibrato_depth != 0.0 ) {
+            frequency *= 1.0 + wave->vibrato_depth * sin(6.283185307179586 * wave->vibrato_phase);
+            wave->vibrato_phase += wave->vibrato_step;
+            wave->vibrato_phase -= floor(wave->vibrato_phase);
+        }
+        
+        if ( frequency > 0.0 ) {
+            // A sound's square wave only completes a cycle every other
+            // period (see SquareWave), so do the same, to sound at the same
+            // pitch. Noise changes every period, like the noise voice.
+            wave->phase += frequency / (wave->noise ? wave->rate : 2.0 * wave->rate);
+            
+            if ( wave->phase >= 1.0 ) {
+                int periods = (int)wave->phase;
+                wave->phase -= periods;
+                
+                while ( wave->noise && periods-- ) {
+                    Uint16 bit = (wave->lfsr ^ (wave->lfsr >> 1)) & 1;
+                    wave->lfsr = (wave->lfsr >> 1) | (bit << 14);
+                }
+            }
+            
+            bool high;
+            if ( wave->noise ) {
+                high = wave->lfsr & 1;
+            } else {
+                high = wave->phase >= 1.0 - wave->duty;
+            }
+            
+            out[written] = high ? wave->amplitude : -wave->amplitude;
+        } else {
+            out[written] = 0; // silence
+        }
+        
+        wave->frequency = wave->frequency * wave->ratio + wave->step;
+        written++;
+        wave->position++;
+    }
+    
+    return written;
+}
+
+// DOS_SOUND_SYNTHESIZED
+//
+// Each channel has its own queue of sounds, which the audio callback plays and
+// mixes together: the PC speaker (DOS_Sound, DOS_Play, etc.), followed by the
+// voices (DOS_VoiceSound, DOS_VoicePlay, etc.).
+
+#define NUM_CHANNELS (1 + DOS_NUM_VOICES)
+#define SPEAKER 0
+
+typedef struct
+{
+    SoundEvent      events[SYNTH_QUEUE_SIZE];
+    Ring            ring;
+    bool            is_noise;
+    
+    // Events pushed before this sequence number were stopped and are skipped.
+    SDL_atomic_t    stop_mark;
+    
+    // Owned by the audio callback:
+    SquareWave      wave; // the sound currently playing
+    Noise           noise; // (or this, for a noise channel)
+    Effect          effect; // (or this, if `is_effect`)
+    bool            is_effect;
+    unsigned        sequence;
+    bool            playing;
+    
+    // Published by the audio callback for other threads:
+    SDL_atomic_t    current; // sequence number of the sound playing
+    SDL_atomic_t    current_remaining; // samples left in it
+    SDL_atomic_t    current_note; // its index in a PLAY string, or -1
+} Channel;
+
+static Channel channels[NUM_CHANNELS];
+
+// Stats, published by the audio callback:
+static SDL_atomic_t underruns;
+static SDL_atomic_t trigger_time = { -1 }; // ms, for the last sound started
+
+// Samples synthesized since sound was initialized. (Wraps around.)
+static Uint32 clock_samples; // owned by the audio callback
+static bool clock_heard; // whether the first buffer has been heard yet
+static SDL_atomic_t sound_clock; // published: samples heard
+
+// Markers that have been reached, waiting for DOS_PollSoundMarker.
+
+#define MARKER_QUEUE_SIZE 256
+
+static DOS_SoundMarker markers[MARKER_QUEUE_SIZE];
+static Ring marker_ring = {
+    .items = markers,
+    .item_size = sizeof(DOS_SoundMarker),
+    .capacity = MARKER_QUEUE_SIZE,
+};
+
+// The marker callback and its data, published together as one MarkerCallback
+// that isn't changed after it's published, so that the audio callback gets
+// both with a single atomic load and never waits. One that's been replaced
+// goes on `retired_callbacks` and is freed once the Synthesize that might
+// still be using it has finished.
+typedef struct MarkerCallback {
+    DOS_SoundMarkerCallback callback;
+    void *      data;
+    unsigned    retired_at; // `synthesize_count` when it was replaced
+    struct MarkerCallback * next; // on `retired_callbacks`
+} MarkerCallback;
+
+static void * marker_callback; // the current MarkerCallback, or NULL
+static SDL_atomic_t synthesize_count; // calls to Synthesize that have finished
+static MarkerCallback * retired_callbacks; // guarded by `marker_callback_lock`
+static SDL_SpinLock marker_callback_lock; // serializes setters
+
+static void ReachMarker(const DOS_SoundMarker * marker)
+{
+    const MarkerCallback * current = SDL_AtomicGetPtr(&marker_callback);
+    
+    if ( current ) {
+        current->callback(marker, current->data);
+    } else {
+        RingPush(&marker_ring, marker); // (dropped if full)
+    }
+}
+
+// Sequence number `a` comes before `b`.
+static bool Before(unsigned a, unsigned b)
+{
+    return (int)(a - b) < 0;
+}
 
-        if ( frequency == 0 ) {
-            sample = spec.silence;
+static int ChannelSamplesLeft(const Channel * channel)
+{
+    if ( channel->is_effect ) {
+        return channel->effect.length - channel->effect.position;
+    }
+    
+    if ( channel->is_noise ) {
+        return channel->noise.length - channel->noise.position;
+    }
+    
+    return channel->wave.length - channel->wave.position;
+}
+
+// Write up to `count` samples of the channel's sounds to `out`, which starts
+// at sample `time` of the stream. Returns the number written, which is less
+// than `count` if it ran out of sounds.
+static int GenerateChannel(Channel * channel, int8_t * out, int count, Uint32 time)
+{
+    int written = 0;
+    unsigned stop_mark = SDL_AtomicGet(&channel->stop_mark);
+    
+    if ( channel->playing && Before(channel->sequence, stop_mark) ) {
+        channel->playing = false;
+    }
+    
+    // Whether the next sound starts right away, rather than after another.
+    bool idle = !channel->playing;
+    
+    while ( written < count ) {
+        if ( !channel->playing ) {
+            SoundEvent event;
+            unsigned sequence;
+            
+            if ( !RingPop(&channel->ring, &event, &sequence) ) {
+                break;
+            }
+            
+            if ( Before(sequence, stop_mark) ) {
+                continue; // stopped before it started
+            }
+            
+            if ( event.tag != -1 ) {
+                DOS_SoundMarker marker;
+                marker.tag = event.tag;
+                marker.note = event.note;
+                marker.voice = (int)(channel - channels) - (SPEAKER + 1);
+                marker.time = time + written;
+                ReachMarker(&marker);
+                continue;
+            }
+            
+            channel->is_effect = event.is_effect;
+            
+            if ( event.is_effect ) {
+                StartEffect(&channel->effect,
+                            &event.effect,
+                            spec.freq,
+                            event.amplitude);
+            } else if ( channel->is_noise ) {
+                StartNoise(&channel->noise,
+                           event.frequency,
+                           event.milliseconds,
+                           spec.freq,
+                           event.amplitude);
+            } else {
+                StartSquareWave(&channel->wave,
+                                event.frequency,
+                                event.milliseconds,
+                                spec.freq,
+                                event.amplitude);
+            }
+            
+            if ( idle && engine == DOS_SOUND_SYNTHESIZED ) {
+                int offset_ms = (int)((Sint64)written * 1000 / spec.freq);
+                SDL_AtomicSet(&trigger_time, SDL_GetTicks() - event.time + offset_ms);
+            }
+            
+            channel->sequence = sequence;
+            channel->playing = true;
+            SDL_AtomicSet(&channel->current_note, event.note);
+            idle = false;
+        }
+        
+        if ( channel->is_effect ) {
+            written += GenerateEffect(&channel->effect, out + written, count - written);
+        } else if ( channel->is_noise ) {
+            written += GenerateNoise(&channel->noise, out + written, count - written);
         } else {
-            sample = (int)((float)i / period) % 2 ? volume : -volume;
+            written += GenerateSquareWave(&channel->wave, out + written, count - written);
+        }
+        
+        if ( ChannelSamplesLeft(channel) == 0 ) {
+            channel->playing = false;
+        }
+    }
+    
+    SDL_AtomicSet(&channel->current, channel->sequence);
+    SDL_AtomicSet(&channel->current_remaining,
+                  channel->playing ? ChannelSamplesLeft(channel) : 0);
+    
+    return written;
+}
+
+// Add `in` to `out`, clipping.
+static void MixSamples(int8_t * out, const int8_t * in, int count)
+{
+    int i = 0;
+    
+#ifdef __SSE2__
+    for ( ; i + 16 <= count; i += 16 ) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(out + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(in + i));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_adds_epi8(a, b));
+    }
+#endif
+    
+    for ( ; i < count; i++ ) {
+        int sample = out[i] + in[i];
+        out[i] = sample > INT8_MAX ? INT8_MAX : sample < INT8_MIN ? INT8_MIN : sample;
+    }
+}
+
+#define MIX_BLOCK_SIZE 1024
+
+// Fill `out` with the next `len` samples of all channels. Returns how many
+// samples there were before every channel ran out of sound.
+static int Synthesize(int8_t * out, int len)
+{
+    // The speaker is generated straight into the stream, then voices that
+    // are playing are mixed in.
+    int written = GenerateChannel(&channels[SPEAKER], out, len, clock_samples);
+    memset(out + written, spec.silence, len - written);
+    
+    static int8_t block[MIX_BLOCK_SIZE];
+    int end = written;
+    
+    for ( int i = SPEAKER + 1; i < NUM_CHANNELS; i++ ) {
+        int mixed = 0;
+        
+        while ( mixed < len ) {
+            int count = len - mixed < MIX_BLOCK_SIZE ? len - mixed : MIX_BLOCK_SIZE;
+            int generated = GenerateChannel(&channels[i], block, count, clock_samples + mixed);
+            
+            MixSamples(out + mixed, block, generated);
+            mixed += generated;
+            
+            if ( generated < count ) {
+                break; // nothing left to play
+            }
+        }
+        
+        if ( mixed > end ) {
+            end = mixed;
+        }
+    }
+    
+    clock_samples += len;
+    
+    // The device is still playing the buffer before this one, so what's been
+    // heard is one buffer behind what's been synthesized.
+    Uint32 buffered = device != 0 ? spec.samples : 0;
+    if ( clock_samples >= buffered || clock_heard ) {
+        clock_heard = true;
+        SDL_AtomicSet(&sound_clock, clock_samples - buffered);
+    }
+    
+    SDL_AtomicAdd(&synthesize_count, 1);
+    
+    return end;
+}
+
+static void SynthCallback(void * userdata, Uint8 * stream, int len)
+{
+    (void)userdata;
+    
+    // If the device asks for sound much later than expected, whatever was
+    // playing has likely dropped out.
+    static Uint64 last_call;
+    static bool was_playing;
+    Uint64 now = SDL_GetPerformanceCounter();
+    Uint64 expected = (Uint64)len * SDL_GetPerformanceFrequency() / spec.freq;
+    
+    if ( was_playing && now - last_call > expected + expected / 2 ) {
+        SDL_AtomicAdd(&underruns, 1);
+    }
+    
+    last_call = now;
+    was_playing = Synthesize((int8_t *)stream, len) > 0;
+}
+
+static void PushSoundEvent(Channel * channel, const SoundEvent * event)
+{
+    // report the first overflow; after that, see DOS_SoundOverflowCount
+    if ( !RingPushShared(&channel->ring, event)
+        && SDL_AtomicGet(&channel->ring.overflows) == 1 ) {
+        fprintf(stderr, "DOS_AddSound: sound queue full (max %d)\n", SYNTH_QUEUE_SIZE);
+    }
+}
+
+static void
+SynthAddSound
+(   Channel * channel,
+    unsigned frequency,
+    unsigned milliseconds,
+    int note,
+    int tag )
+{
+    SoundEvent event;
+    event.frequency = frequency;
+    event.milliseconds = milliseconds;
+    event.amplitude = volume;
+    event.time = SDL_GetTicks();
+    event.note = note;
+    event.tag = tag;
+    event.is_effect = false;
+    
+    PushSoundEvent(channel, &event);
+}
+
+static void SynthAddEffect(Channel * channel, const DOS_SoundEffect * effect)
+{
+    SoundEvent event;
+    event.frequency = 0;
+    event.milliseconds = effect->milliseconds;
+    event.amplitude = volume;
+    event.time = SDL_GetTicks();
+    event.note = -1;
+    event.tag = -1;
+    event.is_effect = true;
+    event.effect = *effect;
+    
+    PushSoundEvent(channel, &event);
+}
+
+static void SynthStopSound(Channel * channel)
+{
+    // Everything pushed so far is stopped. Holding the producer lock means
+    // no other thread is in the middle of pushing.
+    SDL_AtomicLock(&channel->ring.producer_lock);
+    SDL_AtomicSet(&channel->stop_mark, SDL_AtomicGet(&channel->ring.tail));
+    SDL_AtomicUnlock(&channel->ring.producer_lock);
+}
+
+static Uint32 ChannelSamplesRemaining(Channel * channel)
+{
+    Uint32 samples = 0;
+    unsigned stop_mark = SDL_AtomicGet(&channel->stop_mark);
+    
+    if ( !Before(SDL_AtomicGet(&channel->current), stop_mark) ) {
+        samples += SDL_AtomicGet(&channel->current_remaining);
+    }
+    
+    // Events waiting to be played. The callback may pop one while it's read
+    // here, and a producer may then reuse its slot, so each is copied and
+    // only counted if the head hasn't passed it since.
+    unsigned tail = SDL_AtomicGet(&channel->ring.tail);
+    unsigned i = SDL_AtomicGet(&channel->ring.head);
+    
+    if ( Before(i, stop_mark) ) {
+        i = stop_mark;
+    }
+    
+    SDL_MemoryBarrierAcquire(); // see the items as written
+    
+    for ( ; i != tail; i++ ) {
+        const SoundEvent * event = RingSlot(&channel->ring, i);
+        unsigned milliseconds;
+        
+        memcpy(&milliseconds, &event->milliseconds, sizeof(milliseconds));
+        SDL_MemoryBarrierAcquire(); // read the slot before checking the head
+        
+        unsigned head = SDL_AtomicGet(&channel->ring.head);
+        
+        if ( Before(i, head) ) { // popped (and now playing, or done)
+            if ( !Before(head, tail) ) {
+                break;
+            }
+            i = head - 1; // skip ahead
+            continue;
         }
+        
+        samples += (float)spec.freq * ((float)milliseconds / 1000.0f);
+    }
+    
+    return samples;
+}
 
-        SDL_QueueAudio(device, &sample, sizeof(sample));
+static Uint32 SamplesRemaining(void)
+{
+    if ( engine == DOS_SOUND_QUEUED ) {
+        // one byte per sample (AUDIO_S8, mono)
+        return SDL_GetQueuedAudioSize(device);
+    }
+    
+    return ChannelSamplesRemaining(&channels[SPEAKER]);
+}
+
+unsigned DOS_SoundOverflowCount(void)
+{
+    unsigned count = 0;
+    
+    for ( int i = 0; i < NUM_CHANNELS; i++ ) {
+        count += SDL_AtomicGet(&channels[i].ring.overflows);
     }
+    
+    return count;
+}
+
+// Voices
+
+// Returns the voice's channel, or NULL if it can't be used.
+static Channel * VoiceChannel(int voice)
+{
+    if ( voice < 0 || voice >= DOS_NUM_VOICES ) {
+        fprintf(stderr, "bad voice %d, expected value in range 0-%d\n", voice, DOS_NUM_VOICES - 1);
+        return NULL;
+    }
+    
+    if ( engine == DOS_SOUND_QUEUED ) {
+        fprintf(stderr, "voices are not available with DOS_SOUND_QUEUED\n");
+        return NULL;
+    }
+    
+    return &channels[SPEAKER + 1 + voice];
+}
+
+void DOS_VoiceAddSound(int voice, unsigned frequency, unsigned milliseconds)
+{
+    Channel * channel = VoiceChannel(voice);
+    
+    if ( channel && !is_muted ) {
+        SynthAddSound(channel, frequency, milliseconds, -1, -1);
+    }
+}
+
+void DOS_VoiceSound(int voice, unsigned frequency, unsigned milliseconds)
+{
+    Channel * channel = VoiceChannel(voice);
+    
+    if ( channel ) {
+        SynthStopSound(channel);
+        if ( !is_muted ) {
+            SynthAddSound(channel, frequency, milliseconds, -1, -1);
+        }
+    }
+}
+
+void DOS_VoiceStopSound(int voice)
+{
+    Channel * channel = VoiceChannel(voice);
+    
+    if ( channel ) {
+        SynthStopSound(channel);
+    }
+}
+
+bool DOS_VoiceIsPlaying(int voice)
+{
+    Channel * channel = VoiceChannel(voice);
+    
+    return channel && ChannelSamplesRemaining(channel) > 0;
+}
+
+void DOS_VoiceAddEffect(int voice, const DOS_SoundEffect * effect)
+{
+    Channel * channel = VoiceChannel(voice);
+    
+    if ( channel && !is_muted ) {
+        SynthAddEffect(channel, effect);
+    }
+}
+
+void DOS_VoiceEffect(int voice, const DOS_SoundEffect * effect)
+{
+    Channel * channel = VoiceChannel(voice);
+    
+    if ( channel ) {
+        SynthStopSound(channel);
+        if ( !is_muted ) {
+            SynthAddEffect(channel, effect);
+        }
+    }
+}
+
+// Markers and the playback clock
+
+// Used by play.c: add a sound from a PLAY string, or a marker, to the speaker
+// (voice -1) or a voice. With DOS_SOUND_QUEUED, markers are ignored.
+void DOS_AddPlaySound(int voice, unsigned frequency, unsigned milliseconds, int note)
+{
+    if ( engine == DOS_SOUND_QUEUED ) {
+        if ( voice == -1 ) {
+            DOS_AddSound(frequency, milliseconds);
+        } else {
+            DOS_VoiceAddSound(voice, frequency, milliseconds); // (error)
+        }
+        return;
+    }
+    
+    Channel * channel = voice == -1 ? &channels[SPEAKER] : VoiceChannel(voice);
+    if ( channel && !is_muted ) {
+        SynthAddSound(channel, frequency, milliseconds, note, -1);
+    }
+}
+
+void DOS_AddSoundMarker(int voice, int tag, int note)
+{
+    if ( engine == DOS_SOUND_QUEUED ) {
+        return;
+    }
+    
+    Channel * channel = voice == -1 ? &channels[SPEAKER] : VoiceChannel(voice);
+    if ( channel ) {
+        SynthAddSound(channel, 0, 0, note, tag);
+    }
+}
+
+Uint32 DOS_GetSoundClock(void)
+{
+    return SDL_AtomicGet(&sound_clock);
+}
+
+int DOS_GetPlayPosition(void)
+{
+    if ( engine == DOS_SOUND_QUEUED ) {
+        return -1;
+    }
+    
+    Channel * speaker = &channels[SPEAKER];
+    unsigned stop_mark = SDL_AtomicGet(&speaker->stop_mark);
+    
+    if ( SDL_AtomicGet(&speaker->current_remaining) == 0
+        || Before(SDL_AtomicGet(&speaker->current), stop_mark) ) {
+        return -1;
+    }
+    
+    return SDL_AtomicGet(&speaker->current_note);
+}
+
+bool DOS_PollSoundMarker(DOS_SoundMarker * marker)
+{
+    unsigned sequence;
+    
+    return RingPop(&marker_ring, marker, &sequence);
+}
+
+void DOS_SetSoundMarkerCallback(DOS_SoundMarkerCallback callback, void * data)
+{
+    MarkerCallback * new = NULL;
+    
+    if ( callback ) {
+        new = malloc(sizeof(*new));
+        if ( new == NULL ) {
+            fprintf(stderr, "%s: out of memory\n", __func__);
+            return;
+        }
+        
+        new->callback = callback;
+        new->data = data;
+    }
+    
+    SDL_AtomicLock(&marker_callback_lock);
+    
+    MarkerCallback * old = SDL_AtomicSetPtr(&marker_callback, new);
+    unsigned now = SDL_AtomicGet(&synthesize_count);
+    
+    // Free those that no Synthesize can be using anymore: any that was
+    // running when one was replaced has finished since.
+    MarkerCallback ** link = &retired_callbacks;
+    while ( *link ) {
+        MarkerCallback * retired = *link;
+        if ( retired->retired_at != now ) {
+            *link = retired->next;
+            free(retired);
+        } else {
+            link = &retired->next;
+        }
+    }
+    
+    if ( old ) {
+        old->retired_at = now;
+        old->next = retired_callbacks;
+        retired_callbacks = old;
+    }
+    
+    SDL_AtomicUnlock(&marker_callback_lock);
+}
+
+// Once nothing is synthesizing.
+static void FreeMarkerCallbacks(void)
+{
+    free(SDL_AtomicSetPtr(&marker_callback, NULL));
+    
+    while ( retired_callbacks ) {
+        MarkerCallback * retired = retired_callbacks;
+        retired_callbacks = retired->next;
+        free(retired);
+    }
+}
+
+#define SOUND_BLOCK_SIZE 4096
+
+// DOS_SOUND_QUEUED: a cache of generated sounds, so that sounds played over and
+// over (key clicks, DOS_Beep, etc.) are generated once and then queued with a
+// single SDL_QueueAudio. Least recently used sounds are evicted to stay under
+// the limit.
+
+#define SOUND_CACHE_ENTRIES 64
+
+typedef struct
+{
+    unsigned    frequency;
+    unsigned    milliseconds;
+    int8_t      amplitude;
+    int8_t *    samples; // NULL if the entry is unused
+    int         length;
+    unsigned    last_used;
+} CachedSound;
+
+static CachedSound sound_cache[SOUND_CACHE_ENTRIES];
+static size_t sound_cache_limit = 256 * 1024;
+static unsigned sound_cache_clock; // for least recently used
+static DOS_SoundCacheStats sound_cache_stats;
+
+// Sounds are generated with the lock held, so it's a mutex: another thread
+// adding a sound waits without spinning. It also keeps each sound's blocks
+// together in the queue.
+static SDL_mutex * sound_cache_lock;
+
+static void LockSoundCache(void)
+{
+    static SDL_SpinLock create_lock;
+    
+    SDL_AtomicLock(&create_lock);
+    if ( sound_cache_lock == NULL ) {
+        sound_cache_lock = SDL_CreateMutex();
+    }
+    SDL_AtomicUnlock(&create_lock);
+    
+    SDL_LockMutex(sound_cache_lock);
+}
+
+static void UnlockSoundCache(void)
+{
+    SDL_UnlockMutex(sound_cache_lock);
+}
+
+static void EvictSound(CachedSound * entry)
+{
+    sound_cache_stats.bytes -= entry->length;
+    sound_cache_stats.count--;
+    sound_cache_stats.evictions++;
+    free(entry->samples);
+    entry->samples = NULL;
+}
+
+static CachedSound * FindCachedSound(unsigned frequency, unsigned milliseconds)
+{
+    for ( int i = 0; i < SOUND_CACHE_ENTRIES; i++ ) {
+        CachedSound * entry = &sound_cache[i];
+        if ( entry->samples
+            && entry->frequency == frequency
+            && entry->milliseconds == milliseconds
+            && entry->amplitude == volume ) {
+            entry->last_used = ++sound_cache_clock;
+            return entry;
+        }
+    }
+    
+    return NULL;
+}
+
+// Generate a sound and add it to the cache. Returns NULL if it doesn't fit.
+// Call with the lock held.
+static CachedSound * CacheSound(unsigned frequency, unsigned milliseconds)
+{
+    SquareWave wave;
+    StartSquareWave(&wave, frequency, milliseconds, spec.freq, volume);
+    
+    if ( wave.length == 0 || (size_t)wave.length > sound_cache_limit ) {
+        return NULL;
+    }
+    
+    // evict least recently used sounds until there's room and a free entry
+    while ( true ) {
+        CachedSound * free_entry = NULL;
+        CachedSound * oldest = NULL;
+        
+        for ( int i = 0; i < SOUND_CACHE_ENTRIES; i++ ) {
+            CachedSound * entry = &sound_cache[i];
+            if ( entry->samples == NULL ) {
+                free_entry = entry;
+            } else if ( oldest == NULL || entry->last_used < oldest->last_used ) {
+                oldest = entry;
+            }
+        }
+        
+        if ( free_entry && sound_cache_stats.bytes + wave.length <= sound_cache_limit ) {
+            free_entry->samples = malloc(wave.length);
+            if ( free_entry->samples == NULL ) {
+                return NULL;
+            }
+            
+            GenerateSquareWave(&wave, free_entry->samples, wave.length);
+            free_entry->frequency = frequency;
+            free_entry->milliseconds = milliseconds;
+            free_entry->amplitude = volume;
+            free_entry->length = wave.length;
+            free_entry->last_used = ++sound_cache_clock;
+            
+            sound_cache_stats.bytes += wave.length;
+            sound_cache_stats.count++;
+            
+            return free_entry;
+        }
+        
+        EvictSound(oldest);
+    }
+}
+
+void DOS_PreloadSound(unsigned frequency, unsigned milliseconds)
+{
+    if ( engine != DOS_SOUND_QUEUED ) {
+        return;
+    }
+    
+    LockSoundCache();
+    if ( FindCachedSound(frequency, milliseconds) == NULL ) {
+        CacheSound(frequency, milliseconds);
+    }
+    UnlockSoundCache();
+}
+
+void DOS_SetSoundCacheLimit(size_t bytes)
+{
+    LockSoundCache();
+    
+    sound_cache_limit = bytes;
+    
+    // evict least recently used sounds until under the limit
+    while ( sound_cache_stats.bytes > bytes ) {
+        CachedSound * oldest = NULL;
+        
+        for ( int i = 0; i < SOUND_CACHE_ENTRIES; i++ ) {
+            CachedSound * entry = &sound_cache[i];
+            if ( entry->samples
+                && (oldest == NULL || entry->last_used < oldest->last_used) ) {
+                oldest = entry;
+            }
+        }
+        
+        EvictSound(oldest);
+    }
+    
+    UnlockSoundCache();
+}
+
+void DOS_GetSoundCacheStats(DOS_SoundCacheStats * stats)
+{
+    LockSoundCache();
+    *stats = sound_cache_stats;
+    UnlockSoundCache();
+}
+
+void DOS_AddSound(unsigned frequency, unsigned milliseconds)
+{
+    if ( is_muted ) {
+        return;
+    }
+    
+    if ( engine != DOS_SOUND_QUEUED ) {
+        SynthAddSound(&channels[SPEAKER], frequency, milliseconds, -1, -1);
+        return;
+    }
+    
+    LockSoundCache();
+    
+    CachedSound * cached = FindCachedSound(frequency, milliseconds);
+    if ( cached ) {
+        sound_cache_stats.hits++;
+    } else {
+        sound_cache_stats.misses++;
+        cached = CacheSound(frequency, milliseconds);
+    }
+    
+    if ( cached ) {
+        SDL_QueueAudio(device, cached->samples, cached->length);
+    } else {
+        // too long to cache: generate a block at a time
+        int8_t block[SOUND_BLOCK_SIZE];
+        
+        SquareWave wave;
+        StartSquareWave(&wave, frequency, milliseconds, spec.freq, volume);
+        
+        int count;
+        while ( (count = GenerateSquareWave(&wave, block, SOUND_BLOCK_SIZE)) > 0 ) {
+            SDL_QueueAudio(device, block, count);
+        }
+    }
+    
+    UnlockSoundCache();
+}
+
+void DOS_AddEffect(const DOS_SoundEffect * effect)
+{
+    if ( is_muted ) {
+        return;
+    }
+    
+    if ( engine != DOS_SOUND_QUEUED ) {
+        SynthAddEffect(&channels[SPEAKER], effect);
+        return;
+    }
+    
+    LockSoundCache(); // guards `wave`
+    
+    int8_t block[SOUND_BLOCK_SIZE];
+    static Effect wave; // (keeps the phase between effects)
+    StartEffect(&wave, effect, spec.freq, volume);
+    
+    int count;
+    while ( (count = GenerateEffect(&wave, block, SOUND_BLOCK_SIZE)) > 0 ) {
+        SDL_QueueAudio(device, block, count);
+    }
+    
+    UnlockSoundCache();
+}
+
+void DOS_PlayEffect(const DOS_SoundEffect * effect)
+{
+    DOS_StopSound();
+    DOS_AddEffect(effect);
 }
 
 void DOS_InitSound(void)
 {
+    DOS_InitSoundEngine(DOS_SOUND_QUEUED);
+}
+
+void DOS_InitSoundEngine(DOS_SoundEngine sound_engine)
+{
+    DOS_InitSoundEx(sound_engine, 44100, 4096);
+}
+
+void DOS_InitSoundEx(DOS_SoundEngine sound_engine, int rate, int buffer_samples)
+{
+    if ( rate <= 0 || buffer_samples <= 0 || buffer_samples > UINT16_MAX ) {
+        fprintf(stderr, "bad sound rate or buffer size\n");
+        return;
+    }
+    
+    engine = sound_engine;
+    
+    if ( engine != DOS_SOUND_QUEUED ) {
+        for ( int i = 0; i < NUM_CHANNELS; i++ ) {
+            channels[i].ring.items = channels[i].events;
+            channels[i].ring.item_size = sizeof(SoundEvent);
+            channels[i].ring.capacity = SYNTH_QUEUE_SIZE;
+            channels[i].is_noise = i == SPEAKER + 1 + DOS_NOISE_VOICE;
+            SDL_AtomicSet(&channels[i].current_note, -1);
+        }
+    }
+    
+    if ( engine == DOS_SOUND_OFFLINE ) {
+        // no device: sound is only synthesized by DOS_RenderSound
+        spec.freq = rate;
+        spec.format = AUDIO_S8;
+        spec.channels = 1;
+        spec.samples = buffer_samples;
+        spec.silence = 0;
+        return;
+    }
+    
     if ( SDL_WasInit(SDL_INIT_AUDIO) == 0 ) {
         int result = SDL_InitSubSystem(SDL_INIT_AUDIO);
         if ( result < 0 )
@@ -82,11 +1261,15 @@ void DOS_InitSound(void)
     }
 
     SDL_AudioSpec want = {
-        .freq = 44100,
+        .freq = rate,
         .format = AUDIO_S8,
         .channels = 1,
-        .samples = 4096,
+        .samples = buffer_samples,
     };
+    
+    if ( engine == DOS_SOUND_SYNTHESIZED ) {
+        want.callback = SynthCallback;
+    }
 
     device = SDL_OpenAudioDevice(NULL, 0, &want, &spec, 0);
     if ( device == 0 ) {
@@ -98,6 +1281,20 @@ void DOS_InitSound(void)
 }
 
 
+void DOS_GetSoundStats(DOS_SoundStats * stats)
+{
+    stats->rate = spec.freq;
+    stats->buffer_samples = spec.samples;
+    stats->queued_ms = DOS_SoundTimeRemaining();
+    stats->latency_ms = 0;
+    
+    if ( device != 0 && spec.freq ) { // (not DOS_SOUND_OFFLINE)
+        stats->latency_ms = stats->queued_ms + spec.samples * 1000 / spec.freq;
+    }
+    stats->underruns = SDL_AtomicGet(&underruns);
+    stats->trigger_ms = SDL_AtomicGet(&trigger_time);
+}
+
 void DOS_SetVolume(unsigned value)
 {
     if ( value > 15 || value <= 0 ) {
@@ -110,13 +1307,17 @@ void DOS_SetVolume(unsigned value)
 
 void DOS_Sound(unsigned frequency, unsigned milliseconds)
 {
-    SDL_ClearQueuedAudio(device);
+    DOS_StopSound();
     DOS_AddSound(frequency, milliseconds);
 }
 
 void DOS_StopSound(void)
 {
-    SDL_ClearQueuedAudio(device);
+    if ( engine != DOS_SOUND_QUEUED ) {
+        SynthStopSound(&channels[SPEAKER]);
+    } else {
+        SDL_ClearQueuedAudio(device);
+    }
 }
 
 void DOS_Beep(void)
@@ -124,185 +1325,86 @@ void DOS_Beep(void)
     DOS_Sound(800, 200);
 }
 
+// Offline rendering
 
-// Play
-
-// L[1,2,4,8,16,32,64] default: 4
-// O[0...6] default: 4
-// T[32...255] default: 120
-
-// [A...G]([+,#,-][1,2,4,8,16,32,64][.])
-// N[0...84](.)
-// P[v]
-
-static void PlayError(const char * msg, int line_position)
+int DOS_RenderSound(int8_t * buffer, int count)
 {
-    printf("Play syntax error: %s (position %d)\n.", msg, line_position);
+    if ( engine != DOS_SOUND_OFFLINE ) {
+        fprintf(stderr, "DOS_RenderSound: sound engine is not DOS_SOUND_OFFLINE\n");
+        return 0;
+    }
+    
+    return Synthesize(buffer, count);
 }
 
-#define PLAY_STRING_MAX 255
-
-void DOS_Play(const char * string, ...)
+static bool WriteLittleEndian(FILE * file, Uint32 value, int size)
 {
-    if ( strlen(string) > PLAY_STRING_MAX ) {
-        printf("Play error: string too long (max %d)\n", PLAY_STRING_MAX);
-        return;
+    for ( int i = 0; i < size; i++ ) {
+        if ( fputc((value >> (i * 8)) & 0xFF, file) == EOF ) {
+            return false;
+        }
     }
+    
+    return true;
+}
 
-    va_list args;
-    va_start(args, string);
-
-    char buffer[PLAY_STRING_MAX + 1] = { 0 };
-    vsnprintf(buffer, PLAY_STRING_MAX, string, args);
-    va_end(args);
-
-    // default settings
-    int bmp = 120;
-    int oct = 4;
-    int len = 4;
-
-    // A-G
-    static const int note_offsets[7] = { 9, 11, 0, 2, 4, 5, 7 };
-
-    enum {
-        mode_staccato = 6,  // 6/8
-        mode_normal = 7,    // 7/8
-        mode_legato = 8     // 8/8
-    } mode = mode_normal;
-
-    SDL_ClearQueuedAudio(device);
-
-    // queue up whatever's in the string:
-
-    // TODO: could use a big clean up.
-    // TODO: handle tuplet handling
-    // TODO: nice if more articulate choice beyond s, n, and l - specify fraction?
-    const char * str = buffer;
-    while ( *str != '\0') {
-        char c = toupper(*str++);
-        switch ( c ) {
-            case 'A': case 'B': case 'C': case 'D': case 'E': case 'F':
-            case 'G': case 'N': case 'P':
-            {
-                // get note:
-                int note = 0;
-                switch ( c ) {
-                    case 'A': case 'B': case 'C': case 'D': case 'E': case 'F':
-                    case 'G':
-                        note = 1 + (oct) * 12 + note_offsets[c - 'A'];
-                        break;
-                    case 'P':
-                        note = 0;
-                        break;
-                    case 'N': {
-                        int number = (int)strtol(str, (char **)&str, 10);
-                        if ( number < 0 || number > 84 )
-                            return PlayError("bad note number", (int)(str - string));
-                        if ( number > 0 )
-                            note = number;
-                        break;
-                    }
-                    default:
-                        break;
-                }
-
-                // adjust note per accidental:
-                if ( c >= 'A' && c <= 'G' ) {
-                    if ( *str == '+' || *str == '#' ) {
-                        if ( note < 84 )
-                            note++;
-                        str++;
-                    } else if ( *str == '-' ) {
-                        if ( note > 1 )
-                            note--;
-                        str++;
-                    }
-                }
-
-                int d = len;
-
-                // check if there's a note length following a note A-G, set d
-                if ( c != 'N' ) {
-                    int number = (int)strtol(str, (char **)&str, 10);
-                    
-                    // strtol got a number, but it was a bad one
-                    if ( number < 0 || number > 64 )
-                        return PlayError("bad note value", (int)(str - string));
-                    
-                    // strtol found a value number
-                    if ( number > 0 )
-                        d = number;
-                }
-
-                // TODO: this should only happen when after a note length
-                // count dots:
-                int dot_count = 0;
-                while ( *str == '.' ) {
-                    dot_count++;
-                    str++;
-                }
-
-                // adjust duration if there are dots:
-                float total_ms = (60.0f / (float)bmp) * 1000.0f * (4.0f / (float)d);
-                float prolongation = total_ms / 2.0f;
-                while ( dot_count-- ) {
-                    total_ms += prolongation;
-                    prolongation /= 2;
-                }
-
-                // calculate articulation silence:
-                int note_ms = total_ms * ((float)mode / 8.0f);
-                int silence_ms = total_ms * ((8.0f - (float)mode) / 8.0f);
-
-                // and finally, queue it
-                DOS_AddSound(NoteNumberToFrequency(note), note_ms);
-                DOS_AddSound(0, silence_ms);
-                break;
-            } // A-G, N, and P
-
-            case 'T':
-                bmp = (int)strtol(str, (char **)&str, 10);
-                if ( bmp == 0 )
-                    return PlayError("bad tempo", (int)(str - string));
-                break;
-
-            case 'O':
-                if ( *str < '0' || *str > '6' )
-                    return PlayError("bad octave", (int)(str - string));
-                oct = (int)strtol(str, (char **)&str, 10);
-                break;
-
-                // TODO: dots not handled
-            case 'L':
-                len = (int)strtol(str, (char **)&str, 10);
-                if ( len < 1 || len > 64 )
-                    return PlayError("bad length", (int)(str - string));
-                break;
-
-            case '>':
-                if ( oct < 6 )
-                    oct++;
-                break;
-
-            case '<':
-                if ( oct > 0 )
-                    oct--;
-                break;
-
-            case 'M': {
-                char option = toupper(*str++);
-                switch ( option ) {
-                    case 'L': mode = mode_legato; break;
-                    case 'N': mode = mode_normal; break;
-                    case 'S': mode = mode_staccato; break;
-                    default:
-                        return PlayError("bad music option", (int)(str - string));
-                        break;
-                }
-                break;
-            }
-            default:
-                break;
+bool DOS_RenderSoundWAV(const char * path)
+{
+    if ( engine != DOS_SOUND_OFFLINE ) {
+        fprintf(stderr, "DOS_RenderSoundWAV: sound engine is not DOS_SOUND_OFFLINE\n");
+        return false;
+    }
+    
+    FILE * file = fopen(path, "wb");
+    if ( file == NULL ) {
+        fprintf(stderr, "DOS_RenderSoundWAV: could not open '%s'\n", path);
+        return false;
+    }
+    
+    // header, with the sizes filled in once the data is written
+    bool ok = fwrite("RIFF", 1, 4, file) == 4
+        && WriteLittleEndian(file, 0, 4)
+        && fwrite("WAVEfmt ", 1, 8, file) == 8
+        && WriteLittleEndian(file, 16, 4)           // format chunk size
+        && WriteLittleEndian(file, 1, 2)            // PCM
+        && WriteLittleEndian(file, 1, 2)            // channels
+        && WriteLittleEndian(file, spec.freq, 4)    // sample rate
+        && WriteLittleEndian(file, spec.freq, 4)    // bytes per second
+        && WriteLittleEndian(file, 1, 2)            // bytes per frame
+        && WriteLittleEndian(file, 8, 2)            // bits per sample
+        && fwrite("data", 1, 4, file) == 4
+        && WriteLittleEndian(file, 0, 4);
+    
+    static int8_t block[SOUND_BLOCK_SIZE];
+    Uint32 size = 0;
+    int count = SOUND_BLOCK_SIZE;
+    
+    while ( ok && count == SOUND_BLOCK_SIZE ) {
+        count = Synthesize(block, SOUND_BLOCK_SIZE);
+        
+        // 8-bit WAV samples are unsigned
+        for ( int i = 0; i < count; i++ ) {
+            block[i] ^= 0x80;
         }
+        
+        ok = fwrite(block, 1, count, file) == (size_t)count;
+        size += count;
+    }
+    
+    if ( ok && size % 2 ) {
+        ok = fputc(0, file) != EOF; // chunks are padded to an even size
     }
+    
+    ok = ok
+        && fseek(file, 4, SEEK_SET) == 0
+        && WriteLittleEndian(file, 36 + size + size % 2, 4)
+        && fseek(file, 40, SEEK_SET) == 0
+        && WriteLittleEndian(file, size, 4);
+    
+    if ( fclose(file) != 0 || !ok ) {
+        fprintf(stderr, "DOS_RenderSoundWAV: could not write '%s'\n", path);
+        return false;
+    }
+    
+    return true;
 }
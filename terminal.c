@@ -0,0 +1,523 @@
+#include "textmode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// dos_terminal_backend and dos_terminal256_backend: consoles shown in a
+// terminal, e.g. over SSH, by writing escape sequences to standard output.
+// The terminal's contents are tracked, so each present only writes the cells
+// that look different, and the cursor moves and color changes are chosen to
+// take as few bytes as possible.
+
+#define DEFAULT_COLOR   -1 // the terminal's own background (transparent cells)
+#define UNKNOWN         -2 // not known what the terminal is showing
+#define MAX_MOVE        16 // longest cursor movement sequence
+#define MAX_CELL_OUTPUT 48 // most output for one cell: move, colors, glyph
+#define MAX_REPRINT     8  // most unchanged cells written over to move right
+#define COLOR_CACHE     64
+
+typedef struct
+{
+    uint8_t         ch;
+    int16_t         fg;
+    int16_t         bg;
+} Cell;
+
+typedef struct
+{
+    DOS_Console *   console;
+    bool            colors_256; // else the 16 ANSI colors
+    int             width;      // in cells
+    int             height;
+    Cell *          next;       // the console as it should look
+    Cell *          shown;      // the terminal as it looks
+    int *           dirty_left; // per row, range of `next` that may differ
+    int *           dirty_right; // from `shown` (right is exclusive)
+    bool            clear;      // clear the terminal at the next present
+    bool            started;    // anything has been written
+
+    // terminal state
+    int             cursor_x;   // UNKNOWN if not known
+    int             cursor_y;
+    int             fg;         // current colors
+    int             bg;
+
+    char            glyphs[256][3]; // each character in UTF-8
+    uint8_t         glyph_length[256];
+
+    struct {
+        Uint32      key;        // RGB + 1, 0 if unused
+        int16_t     index;
+    } color_cache[COLOR_CACHE];
+
+    char *          out;        // output for one present
+    size_t          out_length;
+} Terminal;
+
+int DOS_GlyphToUTF8(uint8_t ch, char * out);
+
+// The CGA colors in ANSI order.
+static const uint8_t cga_to_ansi[DOS_NUMCOLORS] = {
+    0, 4, 2, 6, 1, 5, 3, 7, 8, 12, 10, 14, 9, 13, 11, 15
+};
+
+static int Distance(SDL_Color a, int r, int g, int b)
+{
+    return (a.r - r) * (a.r - r) + (a.g - g) * (a.g - g) + (a.b - b) * (a.b - b);
+}
+
+// The closest of the 16 colors, as an ANSI color number.
+static int Nearest16(SDL_Color c)
+{
+    int best = 0;
+    int best_distance = INT32_MAX;
+
+    for ( int i = 0; i < DOS_NUMCOLORS; i++ ) {
+        const SDL_Color * p = &dos_palette[i];
+        int distance = Distance(c, p->r, p->g, p->b);
+
+        if ( distance < best_distance ) {
+            best = i;
+            best_distance = distance;
+        }
+    }
+
+    return cga_to_ansi[best];
+}
+
+// The closest color in xterm's 6x6x6 cube or gray ramp (16-255). Colors 0-15
+// are left alone, as terminals change them.
+static int Nearest256(SDL_Color c)
+{
+    static const int levels[6] = { 0x00, 0x5F, 0x87, 0xAF, 0xD7, 0xFF };
+    int cube[3];
+    const Uint8 rgb[3] = { c.r, c.g, c.b };
+
+    for ( int i = 0; i < 3; i++ ) {
+        cube[i] = rgb[i] < 48 ? 0 : rgb[i] < 115 ? 1 : (rgb[i] - 35) / 40;
+    }
+
+    int cube_index = 16 + cube[0] * 36 + cube[1] * 6 + cube[2];
+    int cube_distance = Distance(c, levels[cube[0]], levels[cube[1]], levels[cube[2]]);
+
+    int average = (c.r + c.g + c.b) / 3;
+    int gray = average > 238 ? 23 : average < 8 ? 0 : (average - 3) / 10;
+    int level = 8 + gray * 10;
+    int gray_distance = Distance(c, level, level, level);
+
+    return gray_distance < cube_distance ? 232 + gray : cube_index;
+}
+
+static int TerminalColor(Terminal * t, SDL_Color c)
+{
+    Uint32 key = (c.r << 16 | c.g << 8 | c.b) + 1;
+    int slot = (c.r * 7 + c.g * 3 + c.b) % COLOR_CACHE;
+
+    if ( t->color_cache[slot].key != key ) {
+        t->color_cache[slot].key = key;
+        t->color_cache[slot].index = t->colors_256 ? Nearest256(c) : Nearest16(c);
+    }
+
+    return t->color_cache[slot].index;
+}
+
+// Whether the character shows nothing but its background.
+static bool IsBlank(uint8_t ch)
+{
+    return ch == ' ' || ch == 0 || ch == 0xFF;
+}
+
+static bool SameCell(const Cell * a, const Cell * b)
+{
+    return a->ch == b->ch && a->bg == b->bg && (a->fg == b->fg || IsBlank(a->ch));
+}
+
+static void Append(Terminal * t, const char * bytes, size_t length)
+{
+    memcpy(t->out + t->out_length, bytes, length);
+    t->out_length += length;
+}
+
+// Write the output to the terminal.
+static void Flush(Terminal * t)
+{
+    if ( t->out_length ) {
+        fwrite(t->out, 1, t->out_length, stdout);
+        fflush(stdout);
+        t->out_length = 0;
+    }
+}
+
+// (Re)allocate everything that depends on the console size.
+static bool Allocate(Terminal * t, int w, int h)
+{
+    free(t->next);
+    free(t->shown);
+    free(t->dirty_left);
+    free(t->dirty_right);
+    free(t->out);
+
+    t->width = w;
+    t->height = h;
+    t->next = malloc(w * h * sizeof(*t->next));
+    t->shown = malloc(w * h * sizeof(*t->shown));
+    t->dirty_left = malloc(h * sizeof(*t->dirty_left));
+    t->dirty_right = malloc(h * sizeof(*t->dirty_right));
+    t->out = malloc((size_t)w * h * MAX_CELL_OUTPUT + 64);
+    t->out_length = 0;
+
+    if ( t->next == NULL
+        || t->shown == NULL
+        || t->dirty_left == NULL
+        || t->dirty_right == NULL
+        || t->out == NULL ) {
+        return false;
+    }
+
+    Cell blank = { ' ', DEFAULT_COLOR, DEFAULT_COLOR };
+
+    for ( int i = 0; i < w * h; i++ ) {
+        t->next[i] = blank;
+    }
+
+    for ( int y = 0; y < h; y++ ) {
+        t->dirty_left[y] = 0;
+        t->dirty_right[y] = w;
+    }
+
+    t->clear = true;
+
+    return true;
+}
+
+static void Destroy(void * state)
+{
+    Terminal * t = state;
+
+    // Put the terminal back as it was, with the cursor below the console.
+    if ( t->started && t->out ) {
+        t->out_length = snprintf(t->out, 64, "\x1b[0m\x1b[?7h\x1b[?25h\x1b[%dH\r\n", t->height);
+        Flush(t);
+    }
+
+    free(t->next);
+    free(t->shown);
+    free(t->dirty_left);
+    free(t->dirty_right);
+    free(t->out);
+    free(t);
+}
+
+static void * Create(DOS_Console * console, int w, int h, bool colors_256)
+{
+    Terminal * t = calloc(1, sizeof(*t));
+
+    if ( t == NULL ) {
+        return NULL;
+    }
+
+    t->console = console;
+    t->colors_256 = colors_256;
+
+    if ( !Allocate(t, w, h) ) {
+        Destroy(t);
+        return NULL;
+    }
+
+    for ( int ch = 0; ch < 256; ch++ ) {
+        t->glyph_length[ch] = DOS_GlyphToUTF8(ch, t->glyphs[ch]);
+    }
+
+    return t;
+}
+
+static void * Create16(DOS_Console * console, int w, int h, int cell_w, int cell_h)
+{
+    (void)cell_w;
+    (void)cell_h;
+
+    return Create(console, w, h, false);
+}
+
+static void * Create256(DOS_Console * console, int w, int h, int cell_w, int cell_h)
+{
+    (void)cell_w;
+    (void)cell_h;
+
+    return Create(console, w, h, true);
+}
+
+static void UpdateCells(void * state, int x, int y, const DOS_CharInfo * cells, int count)
+{
+    Terminal * t = state;
+    Cell * row = t->next + y * t->width;
+    SDL_Color fg, bg;
+
+    for ( int i = 0; i < count; i++ ) {
+        DOS_CellColors(t->console, &cells[i], &fg, &bg);
+
+        row[x + i].ch = cells[i].character;
+        row[x + i].fg = TerminalColor(t, fg);
+        row[x + i].bg = bg.a == 0 ? DEFAULT_COLOR : TerminalColor(t, bg);
+    }
+
+    if ( x < t->dirty_left[y] ) {
+        t->dirty_left[y] = x;
+    }
+
+    if ( x + count > t->dirty_right[y] ) {
+        t->dirty_right[y] = x + count;
+    }
+}
+
+static void Clear(void * state)
+{
+    Terminal * t = state;
+    Cell blank = { ' ', DEFAULT_COLOR, DEFAULT_COLOR };
+
+    for ( int i = 0; i < t->width * t->height; i++ ) {
+        t->next[i] = blank;
+    }
+
+    for ( int y = 0; y < t->height; y++ ) {
+        t->dirty_left[y] = 0;
+        t->dirty_right[y] = t->width;
+    }
+}
+
+static bool Resize(void * state, int w, int h)
+{
+    Terminal * t = state;
+
+    t->cursor_x = UNKNOWN;
+    t->cursor_y = UNKNOWN;
+
+    return Allocate(t, w, h);
+}
+
+// Cursor movement
+
+// A relative move of n cells, e.g. "\x1b[3C". 1 is implied.
+static int Relative(char * out, int n, char direction)
+{
+    return n == 1
+        ? snprintf(out, MAX_MOVE, "\x1b[%c", direction)
+        : snprintf(out, MAX_MOVE, "\x1b[%d%c", n, direction);
+}
+
+// A move to column x on the same row.
+static int Horizontal(char * out, int from, int x)
+{
+    if ( x == 0 ) {
+        out[0] = '\r';
+        return 1;
+    }
+
+    char absolute[MAX_MOVE];
+    int absolute_length = snprintf(absolute, MAX_MOVE, "\x1b[%dG", x + 1);
+    int length = Relative(out, abs(x - from), x > from ? 'C' : 'D');
+
+    if ( absolute_length < length ) {
+        memcpy(out, absolute, absolute_length);
+        return absolute_length;
+    }
+
+    return length;
+}
+
+// Whether moving right over cells `from` to x (exclusive) of row y can be done
+// by writing them again, as they are, in the current colors, and if so, how
+// many bytes that takes.
+static int ReprintLength(const Terminal * t, int from, int x, int y)
+{
+    if ( x - from > MAX_REPRINT ) {
+        return -1;
+    }
+
+    const Cell * row = t->shown + y * t->width;
+    int length = 0;
+
+    for ( int i = from; i < x; i++ ) {
+        const Cell * cell = &row[i];
+
+        if ( cell->bg != t->bg || (cell->fg != t->fg && !IsBlank(cell->ch)) ) {
+            return -1;
+        }
+
+        length += t->glyph_length[cell->ch];
+    }
+
+    return length;
+}
+
+// Move the cursor to x, y the cheapest way.
+static void MoveCursor(Terminal * t, int x, int y)
+{
+    int cx = t->cursor_x;
+    int cy = t->cursor_y;
+
+    if ( cx == x && cy == y ) {
+        return;
+    }
+
+    char best[MAX_MOVE * 2];
+    int best_length = x == 0
+        ? snprintf(best, MAX_MOVE, "\x1b[%dH", y + 1)
+        : snprintf(best, MAX_MOVE, "\x1b[%d;%dH", y + 1, x + 1);
+
+    if ( cy != UNKNOWN ) {
+        char move[MAX_MOVE * 2];
+        int length = 0;
+
+        if ( y != cy ) {
+            length = Relative(move, abs(y - cy), y > cy ? 'B' : 'A');
+        }
+
+        if ( x != cx ) {
+            length += Horizontal(move + length, cx, x);
+        }
+
+        if ( length < best_length ) {
+            memcpy(best, move, length);
+            best_length = length;
+        }
+
+        if ( y == cy && x > cx ) {
+            int reprint = ReprintLength(t, cx, x, y);
+
+            if ( reprint >= 0 && reprint <= best_length ) {
+                const Cell * row = t->shown + y * t->width;
+                for ( int i = cx; i < x; i++ ) {
+                    Append(t, t->glyphs[row[i].ch], t->glyph_length[row[i].ch]);
+                }
+                t->cursor_x = x;
+                return;
+            }
+        }
+    }
+
+    Append(t, best, best_length);
+    t->cursor_x = x;
+    t->cursor_y = y;
+}
+
+// Colors
+
+static int ColorParams(char * out, int color, bool background, bool colors_256)
+{
+    if ( color == DEFAULT_COLOR ) {
+        return sprintf(out, background ? "49" : "39");
+    }
+
+    if ( colors_256 ) {
+        return sprintf(out, "%d;5;%d", background ? 48 : 38, color);
+    }
+
+    int base = background ? 40 : 30;
+
+    return sprintf(out, "%d", color < 8 ? base + color : base + 60 + color - 8);
+}
+
+// Change the colors to those of `cell`: only those that differ, and not the
+// foreground if the cell is blank.
+static void SetColors(Terminal * t, const Cell * cell)
+{
+    bool set_bg = cell->bg != t->bg;
+    bool set_fg = cell->fg != t->fg && !IsBlank(cell->ch);
+
+    if ( !set_bg && !set_fg ) {
+        return;
+    }
+
+    char sgr[32] = "\x1b[";
+    int length = 2;
+
+    if ( set_fg ) {
+        length += ColorParams(sgr + length, cell->fg, false, t->colors_256);
+        t->fg = cell->fg;
+    }
+
+    if ( set_bg ) {
+        if ( set_fg ) {
+            sgr[length++] = ';';
+        }
+        length += ColorParams(sgr + length, cell->bg, true, t->colors_256);
+        t->bg = cell->bg;
+    }
+
+    sgr[length++] = 'm';
+    Append(t, sgr, length);
+}
+
+static bool Present(void * state, SDL_Renderer * renderer, const SDL_Rect * dst)
+{
+    (void)renderer;
+    (void)dst;
+
+    Terminal * t = state;
+
+    if ( t->clear ) {
+        // no wrapping or scrolling at the right edge, cursor hidden
+        static const char reset[] = "\x1b[0m\x1b[?7l\x1b[?25l\x1b[H\x1b[2J";
+        Append(t, reset, sizeof(reset) - 1);
+
+        Cell blank = { ' ', DEFAULT_COLOR, DEFAULT_COLOR };
+        for ( int i = 0; i < t->width * t->height; i++ ) {
+            t->shown[i] = blank;
+        }
+
+        t->cursor_x = 0;
+        t->cursor_y = 0;
+        t->fg = DEFAULT_COLOR;
+        t->bg = DEFAULT_COLOR;
+        t->clear = false;
+        t->started = true;
+    }
+
+    for ( int y = 0; y < t->height; y++ ) {
+        Cell * next = t->next + y * t->width;
+        Cell * shown = t->shown + y * t->width;
+
+        for ( int x = t->dirty_left[y]; x < t->dirty_right[y]; x++ ) {
+            if ( SameCell(&next[x], &shown[x]) ) {
+                continue;
+            }
+
+            MoveCursor(t, x, y);
+            SetColors(t, &next[x]);
+            Append(t, t->glyphs[next[x].ch], t->glyph_length[next[x].ch]);
+            shown[x] = next[x];
+
+            // At the right edge, where the cursor goes next depends on the
+            // terminal.
+            t->cursor_x = x + 1 < t->width ? x + 1 : UNKNOWN;
+            t->cursor_y = x + 1 < t->width ? y : UNKNOWN;
+        }
+
+        t->dirty_left[y] = t->width;
+        t->dirty_right[y] = 0;
+    }
+
+    Flush(t);
+
+    return true;
+}
+
+const DOS_Backend dos_terminal_backend = {
+    .create         = Create16,
+    .destroy        = Destroy,
+    .update_cells   = UpdateCells,
+    .present        = Present,
+    .resize         = Resize,
+    .clear          = Clear,
+};
+
+const DOS_Backend dos_terminal256_backend = {
+    .create         = Create256,
+    .destroy        = Destroy,
+    .update_cells   = UpdateCells,
+    .present        = Present,
+    .resize         = Resize,
+    .clear          = Clear,
+};
@@ -5,6 +5,7 @@
 
 const uint8_t * DOS_Data8(uint8_t ch);
 const uint8_t * DOS_Data16(uint8_t ch);
+void DOS_RenderCharCell(SDL_Renderer * renderer, int x, int y, DOS_Font * font, int cell_width, uint8_t character);
 
 DOS_Attributes DOS_DefaultAttributes()
 {
@@ -17,6 +18,16 @@ DOS_Attributes DOS_DefaultAttributes()
     return attr;
 }
 
+int DOS_CharWidth(DOS_Mode mode)
+{
+    return mode >> 8 ? (int)mode >> 8 : DOS_CHAR_WIDTH;
+}
+
+int DOS_CharHeight(DOS_Mode mode)
+{
+    return mode & 0xFF;
+}
+
 void
 DOS_RenderChar
 (   SDL_Renderer * renderer,
@@ -25,21 +36,8 @@ DOS_RenderChar
     DOS_Mode mode,
     uint8_t character)
 {
-    const uint8_t * data;
-    
-    if ( mode == DOS_MODE40 ) {
-        data = DOS_Data8(character);
-    } else {
-        data = DOS_Data16(character);
-    }
-        
-    for ( int y1 = 0; y1 < (int)mode; y1++, data++ ) {
-        for ( int x1 = DOS_CHAR_WIDTH - 1, p = 0; x1 >= 0; x1--, p++ ) {
-            if ( *data & (1 << x1) ) {
-                SDL_RenderDrawPoint(renderer, x + p, y + y1);
-            }
-        }
-    }
+    DOS_Font * font = DOS_GetDefaultFont(mode);
+    DOS_RenderCharCell(renderer, x, y, font, DOS_CharWidth(mode), character);
 }
 
 int DOS_StringWidth(const char * format, ...)
@@ -53,8 +51,64 @@ int DOS_StringWidth(const char * format, ...)
     return len * DOS_CHAR_WIDTH;
 }
 
+int DOS_StringWidthUTF8(const char * format, ...)
+{
+    va_list args, copy;
+    va_start(args, format);
+    va_copy(copy, args);
+    
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    
+    char * buffer = malloc(len + 1);
+    if ( buffer == NULL ) {
+        va_end(copy);
+        return 0;
+    }
+    
+    vsnprintf(buffer, len + 1, format, copy);
+    va_end(copy);
+    
+    len = (int)DOS_UTF8ToCP437(buffer, buffer, len);
+    free(buffer);
+    
+    return len * DOS_CHAR_WIDTH;
+}
+
 
 
+static int
+RenderString
+(   SDL_Renderer * renderer,
+    int x,
+    int y,
+    DOS_Font * font,
+    int cell_width,
+    bool utf8,
+    const char * format,
+    va_list args )
+{
+    va_list copy;
+    va_copy(copy, args);
+    
+    int len = vsnprintf(NULL, 0, format, args);
+    char * buffer = calloc(len + 1, sizeof(char));
+    vsnprintf(buffer, len + 1, format, copy);
+    va_end(copy);
+    
+    if ( utf8 ) {
+        len = (int)DOS_UTF8ToCP437(buffer, buffer, len);
+    }
+    
+    for ( int i = 0; i < len && buffer[i]; i++ ) {
+        DOS_RenderCharCell(renderer, x + i * cell_width, y, font, cell_width, buffer[i]);
+    }
+    
+    free(buffer);
+    
+    return (len + 1) * cell_width;
+}
+
 int
 DOS_RenderString
 (   SDL_Renderer * renderer,
@@ -63,27 +117,62 @@ DOS_RenderString
     DOS_Mode mode,
     const char * format, ...)
 {
-    va_list args[2];
-    va_start(args[0], format);
-    va_copy(args[1], args[0]);
+    va_list args;
+    va_start(args, format);
+    DOS_Font * font = DOS_GetDefaultFont(mode);
+    int width = RenderString(renderer, x, y, font, DOS_CharWidth(mode), false, format, args);
+    va_end(args);
     
-    int len = vsnprintf(NULL, 0, format, args[0]);
-    char * buffer = calloc(len + 1, sizeof(char));
-    vsnprintf(buffer, len + 1, format, args[1]);
-    va_end(args[0]);
-    va_end(args[1]);
+    return width;
+}
+
+int
+DOS_RenderStringUTF8
+(   SDL_Renderer * renderer,
+    int x,
+    int y,
+    DOS_Mode mode,
+    const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    DOS_Font * font = DOS_GetDefaultFont(mode);
+    int width = RenderString(renderer, x, y, font, DOS_CharWidth(mode), true, format, args);
+    va_end(args);
     
-    char * ch = buffer;
-    int x1 = x;
-    while ( *ch ) {
-        DOS_RenderChar(renderer, x1, y, mode, *ch);
-        ch++;
-        x1 += DOS_CHAR_WIDTH;
-    }
+    return width;
+}
+
+int
+DOS_RenderStringFont
+(   SDL_Renderer * renderer,
+    int x,
+    int y,
+    DOS_Font * font,
+    const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int width = RenderString(renderer, x, y, font, DOS_FontWidth(font), false, format, args);
+    va_end(args);
     
-    free(buffer);
+    return width;
+}
+
+int
+DOS_RenderStringFontUTF8
+(   SDL_Renderer * renderer,
+    int x,
+    int y,
+    DOS_Font * font,
+    const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int width = RenderString(renderer, x, y, font, DOS_FontWidth(font), true, format, args);
+    va_end(args);
     
-    return (len + 1) * DOS_CHAR_WIDTH;
+    return width;
 }
 
 const unsigned char * DOS_Data8(unsigned char ch)
@@ -12,10 +12,16 @@ extern "C" {
 #define DOS_NUMCOLORS       16
 #define DOS_CHAR_WIDTH      8
 
+// The low byte is the character height. Modes that aren't 8 pixels wide have
+// the width above it.
 typedef enum
 {
     DOS_MODE40 = 8,  // 'wide' characters (8 x 8)
     DOS_MODE80 = 16, // normal characters (8 x 16, default)
+    DOS_MODE_EGA = 14, // EGA characters (8 x 14)
+    DOS_MODE_VGA = 9 << 8 | 16, // VGA characters (9 x 16): the 9th column is
+                                // blank, except for line drawing characters
+                                // (0xC0-0xDF), which extend into it
 } DOS_Mode;
 
 typedef struct
@@ -24,6 +30,8 @@ typedef struct
     uint8_t bg_color      : 4; // background color
     uint8_t transparent   : 1; // background is transparent
     uint8_t blink         : 1; // text blinks
+    uint8_t cleared       : 1; // blank since the console was cleared: shown
+                               // transparent until written to
 } DOS_Attributes;
 
 typedef struct
@@ -68,11 +76,86 @@ void DOS_SetColor(SDL_Renderer * renderer, DOS_Color color);
 void DOS_SetColorAlpha(SDL_Renderer * renderer, DOS_Color color, uint8_t alpha);
 SDL_Color DOS_CGAToSDL(DOS_Color color);
 
+/**
+ *  The size of a mode's character cells, in pixels.
+ */
+int DOS_CharWidth(DOS_Mode mode);
+int DOS_CharHeight(DOS_Mode mode);
+
 void DOS_RenderChar(SDL_Renderer * renderer, int x, int y, DOS_Mode mode, uint8_t character);
 int DOS_RenderString(SDL_Renderer * renderer, int x, int y, DOS_Mode mode, const char * format,...);
 int DOS_StringWidth(const char * format, ...);
+
+/**
+ *  Render a UTF-8 string, converted to CP437 (see DOS_UTF8ToCP437).
+ */
+int DOS_RenderStringUTF8(SDL_Renderer * renderer, int x, int y, DOS_Mode mode, const char * format,...);
+
+/**
+ *  The width of a UTF-8 string as DOS_RenderStringUTF8 draws it: one character
+ *  per CP437 character it converts to, not per byte.
+ */
+int DOS_StringWidthUTF8(const char * format, ...);
+
+/**
+ *  Convert `length` bytes of UTF-8 to CP437. Characters CP437 does not have,
+ *  and malformed ones, become the replacement character. `dst` needs room for
+ *  `length` bytes and may be the same as `src`. Returns the number of
+ *  characters.
+ */
+size_t DOS_UTF8ToCP437(char * dst, const char * src, size_t length);
+
+/**
+ *  Set the character shown for anything that can't be converted from UTF-8.
+ *  The default is '?'.
+ */
+void DOS_SetReplacementChar(uint8_t ch);
 DOS_Attributes DOS_DefaultAttributes(void);
 
+// FONTS
+
+typedef struct DOS_Font DOS_Font;
+
+/**
+ *  Load a PSF1, PSF2, or raw font (256 glyphs, 8 pixels wide, one byte per
+ *  row). The file is memory-mapped where possible, so loading is near instant
+ *  and glyphs are not copied. 8-pixel wide fonts are also expanded to a byte
+ *  per pixel for drawing consoles: 8 bytes per glyph row, so 32 KB for 256
+ *  8x16 glyphs. Returns NULL on failure.
+ */
+DOS_Font * DOS_LoadFont(const char * path);
+
+/**
+ *  Free a loaded font. It must not be in use by a console, and should be freed
+ *  before destroying a renderer it was rendered with.
+ */
+void DOS_FreeFont(DOS_Font * font);
+
+/**
+ *  Free the glyph textures made for `renderer` by any font. Call this before
+ *  destroying a renderer that text was drawn with. (Screens do this
+ *  themselves.)
+ */
+void DOS_FreeFontTextures(SDL_Renderer * renderer);
+
+/**
+ *  The built-in font for a mode. (Not to be freed.) The 8x14 font is made from
+ *  the 8x16 one by dropping rows. The 9x16 mode uses the 8x16 font: its 9th
+ *  column is added when drawing.
+ */
+DOS_Font * DOS_GetDefaultFont(DOS_Mode mode);
+int DOS_FontWidth(const DOS_Font * font);
+int DOS_FontHeight(const DOS_Font * font);
+
+/**
+ *  Render text with a particular font, in the renderer's draw color. Each font
+ *  keeps its glyphs in a texture per renderer, built the first time it is
+ *  rendered with.
+ */
+void DOS_RenderCharFont(SDL_Renderer * renderer, int x, int y, DOS_Font * font, uint8_t character);
+int DOS_RenderStringFont(SDL_Renderer * renderer, int x, int y, DOS_Font * font, const char * format, ...);
+int DOS_RenderStringFontUTF8(SDL_Renderer * renderer, int x, int y, DOS_Font * font, const char * format, ...);
+
 // CONSOLE
 
 DOS_Console * DOS_CreateConsole(int w, int h, DOS_Mode text_style);
@@ -81,12 +164,42 @@ void DOS_SetActiveConsole(DOS_Console * console);
 void DOS_ClearScreen();
 void DOS_ClearBackground(void);
 void DOS_SetTransparentBackground(void);
+// Show the console with its backend (see RENDER BACKENDS below). By default,
+// it's stored in the renderer's preferred pixel format and kept in a texture
+// that is only updated where it changed. With a NULL renderer, only backends
+// that need none, like dos_terminal_backend, show anything. Free a console
+// before destroying the renderer it was last rendered with.
 void DOS_RenderConsole(SDL_Renderer * renderer, DOS_Console * console, int x, int y);
 void DOS_GotoXY(int x, int y);
 void DOS_SetForeground(int color);
 void DOS_SetBackground(int color);
 void DOS_PrintChar(uint8_t ch);
 void DOS_PrintString(const char * format, ...);
+void DOS_PrintStringUTF8(const char * format, ...);
+
+/**
+ *  Write text containing ANSI escape sequences to the current console, as
+ *  output by terminal programs or stored in .ANS files. It can arrive in
+ *  chunks of any size: a sequence split between calls is continued. Handles
+ *  colors and blink (SGR), cursor movement, erasing (ED, EL, ECH) and
+ *  scrolling. Text wraps and scrolls at the edges. A line feed also returns
+ *  the cursor to the start of the line. OSC strings (ESC ] ... BEL or ST),
+ *  such as window titles, are skipped.
+ */
+void DOS_WriteANSI(const char * data, size_t length);
+
+/**
+ *  Whether the current console is showing an .ANS file. If so, a ^Z marks the
+ *  end of the file (a SAUCE record may follow) and everything after it is
+ *  ignored until DOS_ResetANSI. Otherwise ^Z is shown like other control
+ *  characters. Off by default.
+ */
+void DOS_SetANSIFile(bool ans_file);
+
+/**
+ *  Forget any partial escape sequence and reset the ANSI colors.
+ */
+void DOS_ResetANSI(void);
 int  DOS_GetX(void);
 int  DOS_GetY(void);
 DOS_CharInfo DOS_GetChar();
@@ -97,13 +210,177 @@ void DOS_SetCursorType(DOS_CursorType type);
 void DOS_SetScale(int scale);
 void DOS_SetMargin(int margin);
 
+/**
+ *  Use a font for the current console, or its mode's default font if NULL.
+ *  The font's glyphs must be 8 pixels wide and as tall as the console's cells.
+ */
+void DOS_SetFont(DOS_Font * font);
+
+/**
+ *  Store the console as 8-bit color indices instead of 32-bit colors. The
+ *  palette can then be changed (for fades, flashes, color cycling...) without
+ *  drawing any characters again.
+ */
+void DOS_SetIndexed(bool indexed);
+
+/**
+ *  Resize the current console to w x h characters. What fits is kept, from
+ *  the top left; new cells are blank. A screen's pages can be resized too:
+ *  the screen is laid out again for the size of the page it shows.
+ */
+void DOS_ResizeConsole(int w, int h);
+
+/**
+ *  Change the colors used for DOS_Color values in the current console, e.g.
+ *  `DOS_SetPalette(&my_blue, DOS_BLUE, 1)`. Each console has its own palette.
+ *  This is cheap for indexed consoles: nothing is drawn again, and only rows
+ *  that use a changed color are uploaded again. Others are drawn again.
+ */
+void DOS_SetPalette(const SDL_Color * colors, int first, int count);
+void DOS_ResetPalette(void);
+
+// RENDER BACKENDS
+// A console's cells are kept in memory. How they are shown is up to its
+// backend, which is given the cells that changed each time the console is
+// rendered, so a cell changed several times between frames is passed on once.
+
+typedef struct
+{
+    // Set up for `console`, w x h cells of cell_w x cell_h pixels. Returns the
+    // state passed to the other functions, or NULL on failure.
+    void * (* create)(DOS_Console * console, int w, int h, int cell_w, int cell_h);
+    void (* destroy)(void * state);
+
+    // Start a frame for `renderer`, which may be NULL. Returning false switches
+    // the console to dos_surface_backend.
+    bool (* begin_frame)(void * state, SDL_Renderer * renderer);
+
+    // `count` cells of row y, from column x, have changed to `cells`.
+    void (* update_cells)(void * state, int x, int y, const DOS_CharInfo * cells, int count);
+
+    // End the frame, showing the console at `dst` (in pixels). Returning false
+    // switches the console to dos_surface_backend, which draws it instead.
+    bool (* present)(void * state, SDL_Renderer * renderer, const SDL_Rect * dst);
+
+    // The console is now w x h cells, all of which will be updated. Returns
+    // false on failure.
+    bool (* resize)(void * state, int w, int h);
+
+    // Every cell is now blank and transparent.
+    void (* clear)(void * state);
+} DOS_Backend; // any function may be NULL
+
+// Draws cells to a surface, and uploads it to a texture where it changed. The
+// default.
+extern const DOS_Backend dos_surface_backend;
+
+// Draws the console with a single SDL_RenderGeometry call (SDL 2.0.18 or
+// later): each cell is a background quad and a glyph quad from a font atlas,
+// colored per vertex. Only changed cells' vertices are rewritten, and no
+// pixels are drawn on the CPU except by a software renderer.
+extern const DOS_Backend dos_geometry_backend;
+
+// Draws nothing: the console only exists in memory.
+extern const DOS_Backend dos_memory_backend;
+
+// Show the console in the terminal on standard output (e.g. over SSH), with
+// the 16 ANSI colors or the xterm 256-color palette, and characters as UTF-8.
+// Only cells that look different are written each frame. Render the console
+// with a NULL renderer, or use DOS_DrawScreen on a headless screen.
+extern const DOS_Backend dos_terminal_backend;
+extern const DOS_Backend dos_terminal256_backend;
+
+/**
+ *  Show the current console with `backend`. Everything is drawn again.
+ */
+void DOS_SetBackend(const DOS_Backend * backend);
+
+/**
+ *  For backends: the colors `cell` is shown in, with its blink phase and
+ *  transparency applied.
+ */
+void DOS_CellColors(DOS_Console * console, const DOS_CharInfo * cell, SDL_Color * fg, SDL_Color * bg);
+DOS_Font * DOS_GetConsoleFont(DOS_Console * console);
+
+// TEXT LAYOUT
+
+typedef enum
+{
+    DOS_ALIGN_LEFT,
+    DOS_ALIGN_CENTER,
+    DOS_ALIGN_RIGHT
+} DOS_Align;
+
+typedef struct
+{
+    int         x;      // position and size in the console, in cells
+    int         y;
+    int         w;
+    int         h;
+    DOS_Align   align;
+    Uint32      key;    // if not 0, identifies the text, so its layout can be
+                        // reused (see DOS_PrintText)
+} DOS_TextBox;
+
+typedef struct
+{
+    int         lines;  // including any that don't fit in the box's height
+    int         width;  // of the longest line
+} DOS_TextExtents;
+
+/**
+ *  Print text in a box in the current console, in the current colors,
+ *  wrapped at spaces and aligned on each line. Text that doesn't fit is
+ *  clipped. Line breaks ('\n') are kept, and words wider than the box are
+ *  split. The cursor does not move. Returns the number of lines printed.
+ *
+ *  Nothing is allocated. If `box->key` is not 0, the text's layout is cached
+ *  under that key (a few dozen per thread, for boxes up to 64 lines) and
+ *  reused while the box size and the text's length are the same. Use a new
+ *  key whenever the text changes: text of the same length under the same key
+ *  is taken to be the same. (Debug builds warn when it isn't.)
+ */
+int DOS_PrintText(const DOS_TextBox * box, const char * text, size_t length);
+
+/**
+ *  Measure the text as DOS_PrintText would lay it out, without printing.
+ */
+void DOS_MeasureText(const DOS_TextBox * box, const char * text, size_t length, DOS_TextExtents * extents);
+
 // SCREEN
 // TODO: border color?
+// The screen functions below act on the active screen, which is set per
+// thread. DOS_InitScreen creates a screen and makes it active.
+
+typedef struct DOS_Screen DOS_Screen;
 
 void DOS_InitScreen(const char * window_name, int console_w, int console_h, DOS_Mode text_style, int border_size);
+
+/**
+ *  Create a screen with its own window, renderer and set of pages. If
+ *  `window_name` is NULL, the screen is headless: it has pages, but no window.
+ *  The new screen does not become active. Returns NULL on failure.
+ */
+DOS_Screen * DOS_CreateScreen(const char * window_name, int console_w, int console_h, DOS_Mode text_style, int border_size);
+
+/**
+ *  Free a screen and its pages. A screen that is active on another thread is
+ *  not freed (an error is printed): free it on that thread, or have it call
+ *  `DOS_SetActiveScreen(NULL)` first.
+ */
+void DOS_FreeScreen(DOS_Screen * screen);
+void DOS_SetActiveScreen(DOS_Screen * screen);
+DOS_Screen * DOS_GetActiveScreen(void);
+DOS_Screen * DOS_GetScreenFromWindowID(Uint32 window_id);
+DOS_Console * DOS_GetPage(int page);
 void DOS_DrawScreen(void);
 void DOS_DrawScreenEx(void (* user_function)(void * data), void * user_data);
 void DOS_SwitchPage(int new_page);
+
+/**
+ *  Show all of the active screen's pages with `backend` (see DOS_SetBackend).
+ */
+void DOS_SetScreenBackend(const DOS_Backend * backend);
 int DOS_CurrentPage(void);
 SDL_Window * DOS_GetWindow(void);
 SDL_Renderer * DOS_GetRenderer(void);
@@ -114,15 +391,84 @@ void DOS_IncreaseScreenScale(void);
 void DOS_DecreaseScreenScale(void);
 float DOS_LimitFrameRate(int fps);
 
+/**
+ *  Run the program's main loop. All screens with a window are drawn, then the
+ *  loop sleeps until an event arrives or until it next needs to wake: for a
+ *  cursor or text blink, when sound finishes playing, or when requested with
+ *  `DOS_RequestWakeup`. An idle program uses next to no CPU.
+ *
+ *  `event_handler` is called for each event. It is called with a NULL event
+ *  when the loop wakes for a deadline instead. Return false to exit the loop.
+ *  If `event_handler` is NULL, the loop exits on SDL_QUIT.
+ */
+void DOS_RunLoop(bool (* event_handler)(SDL_Event * event, void * user_data), void * user_data);
+
+/**
+ *  Make `DOS_RunLoop` wake and call its handler after the given time, for
+ *  example to run an animation.
+ */
+void DOS_RequestWakeup(unsigned milliseconds);
+
 // SOUND
 // PC beeper emulation. (Monophonic square wave playback).
 // All sound is played asynchronously.
 
+typedef enum
+{
+    // Sound is rendered to PCM when it's added and queued with SDL_QueueAudio.
+    DOS_SOUND_QUEUED,
+    
+    // Sound is synthesized by the audio callback as it plays. Memory use does
+    // not grow with the length of queued sound, and stopping or replacing
+    // sound takes effect within one audio buffer. Sounds are passed to the
+    // callback through a lock-free queue, so they can be added from any
+    // thread without blocking it.
+    DOS_SOUND_SYNTHESIZED,
+    
+    // Like DOS_SOUND_SYNTHESIZED, but no audio device is opened: sound is
+    // synthesized, faster than real time, only when rendered with
+    // `DOS_RenderSound` or `DOS_RenderSoundWAV`. (Streaming music is not
+    // rendered, since it is fed by a timer.)
+    DOS_SOUND_OFFLINE,
+} DOS_SoundEngine;
+
 /**
  *  Initialize sound. Must be called before using other sound functions.
  */
 void DOS_InitSound(void);
 
+/**
+ *  Initialize sound using the given engine. (`DOS_InitSound` uses
+ *  DOS_SOUND_QUEUED.)
+ */
+void DOS_InitSoundEngine(DOS_SoundEngine engine);
+
+/**
+ *  Initialize sound using the given engine, sample rate, and audio device
+ *  buffer size in samples. (`DOS_InitSoundEngine` uses 44100 and 4096, about
+ *  93 ms.) A smaller buffer lowers latency, at the risk of underruns.
+ */
+void DOS_InitSoundEx(DOS_SoundEngine engine, int rate, int buffer_samples);
+
+typedef struct
+{
+    int         rate;           // samples per second
+    int         buffer_samples; // size of the device buffer
+    int         latency_ms;     // estimated time until a sound added now is
+                                // heard: what's queued ahead of it, plus the
+                                // device buffer being played. (Buffering in
+                                // the OS or hardware can't be seen by SDL.)
+    int         queued_ms;      // sound waiting to be played (PC speaker)
+    
+    // DOS_SOUND_SYNTHESIZED only:
+    unsigned    underruns;  // times the device asked for sound late
+    int         trigger_ms; // time from the last sound that started without
+                            // waiting for another being added to its first
+                            // sample going to the device, or -1 if none
+} DOS_SoundStats;
+
+void DOS_GetSoundStats(DOS_SoundStats * stats);
+
 /** 
  *  Set the volume for all playback.
  *  Valid range: 1-15 (default: 5)
@@ -151,6 +497,12 @@ void DOS_AddSound(unsigned frequency, unsigned milliseconds);
  */
 void DOS_StopSound(void);
 
+/**
+ *  Returns the number of sounds dropped because the sound queue was full.
+ *  (DOS_SOUND_SYNTHESIZED only)
+ */
+unsigned DOS_SoundOverflowCount(void);
+
 /**
  *  Mute or unmute all sound.
  */
@@ -180,9 +532,192 @@ bool DOS_SoundIsPlaying(void);
  *            s: staccato (6/8 length)
  *            n: normal   (7/8 length, default)
  *            l: legato   (8/8 length)
+ *   marker:  ![int]                 "cde !1 fg" (see Markers below)
+ *
+ *  On a syntax error, the error is printed and the notes before it are played.
  */
 void DOS_Play(const char * string, ...);
 
+typedef struct DOS_CompiledPlay DOS_CompiledPlay;
+
+typedef struct
+{
+    const char *    message;
+    int             position; // in the PLAY string
+} DOS_PlayError;
+
+/**
+ *  Parse a PLAY string (see `DOS_Play`) once, into a program that can be
+ *  played any number of times with `DOS_PlayProgram`. There is no limit on the
+ *  length of the string. On a syntax error, returns NULL and fills in `error`,
+ *  if not NULL.
+ */
+DOS_CompiledPlay * DOS_CompilePlay(const char * string, DOS_PlayError * error);
+void DOS_FreeCompiledPlay(DOS_CompiledPlay * program);
+
+/**
+ *  Play a compiled PLAY string, stopping any currently playing sound.
+ */
+void DOS_PlayProgram(const DOS_CompiledPlay * program);
+
+/**
+ *  Play a PLAY string of any length in the background. Notes are parsed and
+ *  queued just ahead of playback, so starting doesn't depend on the length of
+ *  the piece. If `loop` is true, the music restarts at the last loop point
+ *  (`|`) passed, or the beginning. The music plays on the PC speaker, so
+ *  `DOS_Sound` and `DOS_Play` cut off the notes queued so far; the music
+ *  continues after them. (Use a voice for sound effects to avoid this.)
+ */
+void DOS_PlayMusic(const char * string, bool loop);
+
+/**
+ *  Play the PLAY string in a text file as music. Returns false if the file
+ *  could not be read.
+ */
+bool DOS_PlayMusicFile(const char * path, bool loop);
+void DOS_StopMusic(void);
+bool DOS_MusicIsPlaying(void);
+
+typedef enum
+{
+    DOS_SWEEP_LINEAR,       // frequency changes by the same Hz each sample
+    DOS_SWEEP_EXPONENTIAL,  // by the same ratio (even in pitch)
+} DOS_SweepCurve;
+
+/**
+ *  A sound effect, which the synthesizer evaluates a sample at a time, so that
+ *  sweeps, sirens, trills and noise bursts cost one call and no more memory
+ *  than a single sound. Leave fields 0 for no effect.
+ */
+typedef struct
+{
+    unsigned        milliseconds;
+    unsigned        start_frequency;
+    unsigned        end_frequency;  // swept to from the start frequency
+    DOS_SweepCurve  curve;
+    float           vibrato_rate;   // in Hz
+    float           vibrato_depth;  // as a fraction of the frequency, e.g. 0.1
+    int             duty;           // percent of each period that is high, 1-99
+                                    // (0 means 50, a square wave)
+    bool            noise;          // noise that changes at the frequency
+} DOS_SoundEffect;
+
+/**
+ *  Play an effect, stopping any currently playing sound, or add it to the
+ *  queue. Effects queued one after another continue each other's phase.
+ */
+void DOS_PlayEffect(const DOS_SoundEffect * effect);
+void DOS_AddEffect(const DOS_SoundEffect * effect);
+
+typedef struct
+{
+    unsigned    hits;
+    unsigned    misses;
+    unsigned    evictions;
+    size_t      bytes; // memory used by cached sounds
+    int         count; // number of cached sounds
+} DOS_SoundCacheStats;
+
+/**
+ *  With DOS_SOUND_QUEUED, sounds are cached once generated, keyed by
+ *  frequency, duration, and volume, so playing the same sound again just
+ *  queues the cached samples. Set the cache's memory limit in bytes (one byte
+ *  per sample; default 256 KB). A limit of 0 disables the cache.
+ */
+void DOS_SetSoundCacheLimit(size_t bytes);
+
+/**
+ *  Generate and cache a sound at the current volume ahead of time, so that
+ *  it's ready the first time it's played, e.g. during startup.
+ */
+void DOS_PreloadSound(unsigned frequency, unsigned milliseconds);
+void DOS_GetSoundCacheStats(DOS_SoundCacheStats * stats);
+
+/**
+ *  Render the next `count` samples of sound (signed 8-bit, mono, at the rate
+ *  given to `DOS_InitSoundEx`, or 44100 Hz) into `buffer`. Returns the number
+ *  of samples before all queued sound ended, which is less than `count` once
+ *  everything has been rendered; the rest of the buffer is filled with
+ *  silence. (DOS_SOUND_OFFLINE only)
+ */
+int DOS_RenderSound(int8_t * buffer, int count);
+
+/**
+ *  Render all queued sound to an 8-bit WAV file. Returns false if the file
+ *  could not be written. (DOS_SOUND_OFFLINE only)
+ */
+bool DOS_RenderSoundWAV(const char * path);
+
+// Markers
+// With DOS_SOUND_SYNTHESIZED or DOS_SOUND_OFFLINE, a PLAY string can contain
+// markers, `!n`, where n is a tag of your choosing (0 or more). When playback
+// reaches a marker, it is reported with the sample at which it will be heard,
+// so that, e.g., animation can be kept in time with music.
+
+typedef struct
+{
+    int     tag;    // the n in `!n`
+    int     note;   // index of the next note in the PLAY string
+    int     voice;  // -1 for the PC speaker
+    Uint32  time;   // when it's heard, in samples (see DOS_GetSoundClock)
+} DOS_SoundMarker;
+
+typedef void (* DOS_SoundMarkerCallback)(const DOS_SoundMarker * marker, void * data);
+
+/**
+ *  Returns the number of samples played since sound was initialized. It
+ *  advances one audio buffer at a time, and wraps around after 2^32 samples.
+ *  With DOS_SOUND_SYNTHESIZED, it doesn't count the buffer the audio device
+ *  is still playing, which is synthesized (and its markers reached) that much
+ *  earlier. With DOS_SOUND_OFFLINE, it counts the samples rendered.
+ *  (DOS_SOUND_SYNTHESIZED and DOS_SOUND_OFFLINE only)
+ */
+Uint32 DOS_GetSoundClock(void);
+
+/**
+ *  Returns the index of the note currently playing in the PLAY string last
+ *  played on the PC speaker, or -1 if none is.
+ */
+int DOS_GetPlayPosition(void);
+
+/**
+ *  Get the next marker that has been reached. Returns false if there are none.
+ */
+bool DOS_PollSoundMarker(DOS_SoundMarker * marker);
+
+/**
+ *  Have markers passed to `callback` as soon as they are reached, instead of
+ *  saving them for `DOS_PollSoundMarker`. Pass NULL to go back to polling.
+ *  The callback is called on the audio thread, so it should be quick. Setting
+ *  the callback never waits for the audio thread, so one that was already
+ *  running may still finish after this returns.
+ */
+void DOS_SetSoundMarkerCallback(DOS_SoundMarkerCallback callback, void * data);
+
+// Voices
+// With DOS_SOUND_SYNTHESIZED or DOS_SOUND_OFFLINE, there are also several
+// voices (Tandy / PCjr style) that play alongside the PC speaker and each
+// other, so that, for example, a sound effect doesn't interrupt music. The
+// last voice is a noise channel, whose frequency is how often the noise
+// changes.
+
+#define DOS_NUM_VOICES      4
+#define DOS_NOISE_VOICE     3
+
+void DOS_VoiceSound(int voice, unsigned frequency, unsigned milliseconds);
+void DOS_VoiceAddSound(int voice, unsigned frequency, unsigned milliseconds);
+void DOS_VoiceStopSound(int voice);
+bool DOS_VoiceIsPlaying(int voice);
+void DOS_VoiceEffect(int voice, const DOS_SoundEffect * effect);
+void DOS_VoiceAddEffect(int voice, const DOS_SoundEffect * effect);
+
+/**
+ *  Play musical notes (see `DOS_Play`) on a voice, stopping any sound it is
+ *  currently playing.
+ */
+void DOS_VoicePlay(int voice, const char * string, ...);
+void DOS_VoicePlayProgram(int voice, const DOS_CompiledPlay * program);
+
 
 // -----------------------------------------------------------------------------
 // The MS-DOS ASCII Character Set